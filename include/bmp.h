@@ -29,7 +29,8 @@ typedef enum {
     BMP_ERR_MEM_ALLOC,
     BMP_ERR_FILE_READ,
     BMP_ERR_FILE_WRITE,
-    BMP_ERR_ILLEGAL_ARGS
+    BMP_ERR_ILLEGAL_ARGS,
+    BMP_ERR_UNSUPPORTED_FORMAT
 } bmp_err_t;
 
 typedef enum {
@@ -37,13 +38,47 @@ typedef enum {
     BMP_ROT_CLOCKWISE_90
 } bmp_rot_t;
 
+typedef enum {
+    BMP_ENC_RGB,   // Uncompressed rows padded to 4 bytes
+    BMP_ENC_RLE24  // OS/2 2.x BI_RLE24 with a strip index for random-access crops
+} bmp_enc_t;
+
 bmp_err_t load_bmp(bmp_t **bmp, FILE *in_file);
 bmp_err_t save_bmp(const bmp_t *bmp, FILE *out_file);
+// RLE24 saves allocate the strip index, 4 bytes per 16 rows
+bmp_err_t save_bmp_enc(const bmp_t *bmp, FILE *out_file, bmp_enc_t enc);
 bmp_err_t crop_bmp(bmp_t **dst, const bmp_t *src, bmp_rect_t region);
+// Same as load_bmp followed by crop_bmp, but only rows of the region are read.
+// Seekable uncompressed files and indexed RLE24 files skip the rest.
+bmp_err_t load_bmp_region(bmp_t **dst, FILE *in_file, bmp_rect_t region);
 bmp_err_t clone_image(bmp_t **dst, const bmp_t *src);
 bmp_err_t rotate_bmp(bmp_t **dst, const bmp_t *src, bmp_rot_t rot);
 
+// Variants placing the result into a caller-provided buffer instead of malloc.
+// The buffer must be aligned like malloc memory and at least bmp_buffer_size()
+// (or probe_bmp*() for loading) bytes long. free_bmp() on such images is a no-op.
+size_t bmp_buffer_size(bmp_size_t size);
+// Needs a seekable file, fails with BMP_ERR_ILLEGAL_ARGS on pipes.
+// Load from non-seekable streams with load_bmp() instead.
+bmp_err_t probe_bmp(FILE *in_file, size_t *buf_size);
+bmp_err_t load_bmp_into(bmp_t **bmp, FILE *in_file, void *buf, size_t buf_size);
+bmp_err_t crop_bmp_into(bmp_t **dst, const bmp_t *src, bmp_rect_t region, void *buf, size_t buf_size);
+bmp_err_t rotate_bmp_into(bmp_t **dst, const bmp_t *src, bmp_rot_t rot, void *buf, size_t buf_size);
+
+// In-memory counterparts of load_bmp/save_bmp working on whole BMP files
+bmp_err_t probe_bmp_mem(const void *data, size_t data_size, size_t *buf_size);
+bmp_err_t load_bmp_mem(bmp_t **bmp, const void *data, size_t data_size);
+bmp_err_t load_bmp_mem_into(bmp_t **bmp, const void *data, size_t data_size, void *buf, size_t buf_size);
+bmp_err_t load_bmp_mem_region(bmp_t **dst, const void *data, size_t data_size, bmp_rect_t region);
+size_t bmp_file_size(const bmp_t *bmp);
+size_t bmp_file_size_enc(const bmp_t *bmp, bmp_enc_t enc);
+bmp_err_t save_bmp_mem(const bmp_t *bmp, void *data, size_t data_size);
+// Fails with BMP_ERR_ILLEGAL_ARGS when data is smaller than bmp_file_size_enc()
+bmp_err_t save_bmp_mem_enc(const bmp_t *bmp, void *data, size_t data_size,
+                           bmp_enc_t enc, size_t *written);
+
 bmp_err_t get_pixel_in_bmp(const bmp_t *bmp, bmp_pos_t pos, rgb_triple_t **pxl);
+bmp_size_t get_bmp_size(const bmp_t *bmp);
 
 void free_bmp(bmp_t *bmp);
 
@@ -14,13 +14,26 @@ typedef enum {
     STEGO_ILLEGAL_ARGUMENTS = 1,
     STEGO_ERR_READ_KEY = 2,
     STEGO_ERR_READ_BMP = 3,
-    STEGO_ERR_WRITE_MSG = 4
+    STEGO_ERR_WRITE_MSG = 4,
+    STEGO_ERR_KEY_COLLISION = 5,
+    STEGO_ERR_MEM_ALLOC = 6
 } stego_err_t;
 
+typedef struct {
+    size_t entries;        // Well-formed key rows
+    size_t out_of_bounds;  // Rows pointing outside the image
+    size_t duplicates;     // Rows repeating an earlier pixel channel
+    size_t capacity;       // Letters insert accepts. The key may end within the
+                           // terminating '\0', a bad row there costs a letter
+    bool malformed;        // Key ends with a row that could not be parsed
+} stego_key_stats_t;
+
 void init_stego(void);
 stego_err_t put_bit_into_bmp(bmp_t *dst, bmp_pos_t pos, bmp_channel_t channel, bool bit);
 stego_err_t get_bit_from_bmp(const bmp_t *src, bmp_pos_t pos, bmp_channel_t channel, bool *bit);
+// On error dst is left unchanged, bits written so far are rolled back
 stego_err_t write_msg_into_bmp(bmp_t *dst, FILE *key_file, FILE *msg_file);
 stego_err_t read_msg_from_bmp(const bmp_t *src, FILE *key_file, FILE *msg_file);
+stego_err_t analyze_key(const bmp_t *bmp, FILE *key_file, stego_key_stats_t *stats);
 
 #endif //HW_01_STEGO_H
\ No newline at end of file
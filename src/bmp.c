@@ -4,6 +4,7 @@
 #include <math.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
 
 typedef struct __attribute__((packed)) {
     uint16_t bfType;
@@ -32,158 +33,715 @@ struct __bmp{
     BITMAPINFOHEADER info_header;
     bmp_size_t size;
     size_t content_size;
+    bool owns_memory; // False when placed into a caller-provided buffer
     rgb_triple_t **data;
 };
 
+#define BMP_HEADERS_SIZE (sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER))
+#define BMP_BITS_PER_PIXEL 24
+
+// OS/2 2.x BITMAPINFOHEADER2, the only header defining biCompression 4 as RLE24.
+// Its first 40 bytes match BITMAPINFOHEADER, the remaining ones are left zeroed.
+#define OS2_INFO_HEADER_SIZE 64
+#define OS2_HEADERS_SIZE (sizeof(BITMAPFILEHEADER) + OS2_INFO_HEADER_SIZE)
+#define OS2_EXTRA_SIZE (OS2_INFO_HEADER_SIZE - sizeof(BITMAPINFOHEADER))
+
+// biCompression values
+#define BI_RGB 0
+#define BI_RLE24 4
+
+// RLE escape codes following a zero count byte
+#define RLE_END_OF_LINE 0
+#define RLE_END_OF_BITMAP 1
+#define RLE_DELTA 2
+#define RLE_MIN_ABSOLUTE 3
+#define RLE_MAX_RUN 255
+
+// Strip index stored between headers and bfOffBits of RLE24 files we write.
+// Other readers skip it as they start at bfOffBits. Offsets are relative to
+// bfOffBits and point to the first run of every strip of rows, right after
+// the end of line escape of the previous row. Only that is verified, so a
+// damaged index may still give wrong pixels for region loads.
+#define RLE_INDEX_TAG 0x58494C52 // "RLIX"
+#define RLE_STRIP_ROWS 16
+
+typedef struct __attribute__((packed)) {
+    uint32_t tag;
+    uint32_t strip_rows;
+    uint32_t strips;
+} RLE_INDEX_HEADER;
+
+#define BMP_SINK_CHUNK 4096
+
 static inline size_t calc_bmp_content_size(bmp_size_t size) {
     size_t row_size = size.width * sizeof(rgb_triple_t);
     row_size += (4 - row_size % 4) % 4; // Data alignment
     return row_size * size.height;
 }
 
-static void **alloc_2d_array(size_t rows, size_t row_size, size_t content_size) {
+// Image struct, row pointers and pixel content share a single block
+static inline size_t calc_bmp_block_size(size_t rows, size_t content_size) {
+    return sizeof(bmp_t) + sizeof(void *) * rows + content_size;
+}
+
+static bmp_t *place_bmp(void *block, const bmp_t *ref, size_t content_size) {
+    bmp_t *bmp = (bmp_t *) block;
+    *bmp = *ref;
+
+    size_t rows = ref->size.height;
+    size_t row_size = content_size / rows;
     size_t pnt_arr_size = sizeof(void *) * rows;
 
-    void *raw_data = malloc(pnt_arr_size + content_size);
-    if (!raw_data)
-        return NULL;
-    memset(raw_data, 0, pnt_arr_size + content_size);
+    memset((char *) block + sizeof(bmp_t), 0, pnt_arr_size + content_size);
 
-    void **pnt_arr = (void **) raw_data;
-    char *content = (char *) raw_data + pnt_arr_size;
+    void **pnt_arr = (void **) ((char *) block + sizeof(bmp_t));
+    char *content = (char *) pnt_arr + pnt_arr_size;
 
     for (size_t i = 0; i < rows; ++i, content += row_size)
         pnt_arr[i] = content;
 
-    return raw_data;
+    bmp->content_size = content_size;
+    bmp->data = (rgb_triple_t **) pnt_arr;
+    return bmp;
 }
 
-static inline bmp_err_t read_file_header(bmp_t *bmp, FILE *in_file) {
-    size_t read_items = fread(&bmp->file_header, sizeof(BITMAPFILEHEADER), 1, in_file);
-    if (read_items != 1)
-        return BMP_ERR_FILE_READ;
+static bmp_err_t alloc_bmp(bmp_t **dst, const bmp_t *ref, size_t content_size) {
+    void *block = malloc(calc_bmp_block_size(ref->size.height, content_size));
+    if (!block)
+        return BMP_ERR_MEM_ALLOC;
+
+    *dst = place_bmp(block, ref, content_size);
+    (*dst)->owns_memory = true;
+    return BMP_OK;
+}
+
+static bmp_err_t place_bmp_into(bmp_t **dst, const bmp_t *ref, size_t content_size,
+                                void *buf, size_t buf_size) {
+    if ((uintptr_t) buf % _Alignof(bmp_t) != 0 ||
+        buf_size < calc_bmp_block_size(ref->size.height, content_size))
+        return BMP_ERR_ILLEGAL_ARGS;
+
+    *dst = place_bmp(buf, ref, content_size);
+    (*dst)->owns_memory = false;
     return BMP_OK;
 }
 
-static inline bmp_err_t read_info_header(bmp_t *bmp, FILE *in_file) {
-    size_t read_items = fread(&bmp->info_header, sizeof(BITMAPINFOHEADER), 1, in_file);
-    if (read_items != 1)
+static inline bmp_err_t create_bmp_with_size(bmp_t **dst, const bmp_t *ref, bmp_size_t size,
+                                             void *buf, size_t buf_size) {
+    bmp_t sized = *ref;
+    sized.size = size;
+
+    size_t content_size = calc_bmp_content_size(size);
+
+    if (buf)
+        return place_bmp_into(dst, &sized, content_size, buf, buf_size);
+    return alloc_bmp(dst, &sized, content_size);
+}
+
+size_t bmp_buffer_size(bmp_size_t size) {
+    return calc_bmp_block_size(size.height, calc_bmp_content_size(size));
+}
+
+static inline bool region_in_bounds(bmp_size_t size, bmp_rect_t region) {
+    return region.pos.x >= 0 && region.pos.y >= 0 &&
+           region.size.width != 0 && region.size.height != 0 &&
+           (uint64_t) region.pos.x + region.size.width <= size.width &&
+           (uint64_t) region.pos.y + region.size.height <= size.height;
+}
+
+// Pixel data source, either a stream or a memory buffer
+typedef struct {
+    FILE *file;
+    const uint8_t *data;
+    size_t pos, size;
+} bmp_source_t;
+
+static inline int source_getc(bmp_source_t *src) {
+    if (src->file)
+        return getc(src->file);
+    return src->pos < src->size ? src->data[src->pos++] : EOF;
+}
+
+static inline bool source_read(bmp_source_t *src, void *dst, size_t len) {
+    if (src->file)
+        return len == 0 || fread(dst, len, 1, src->file) == 1;
+
+    if (src->size - src->pos < len)
+        return false;
+
+    memcpy(dst, src->data + src->pos, len);
+    src->pos += len;
+    return true;
+}
+
+// Moves forward only, reading instead of seeking when the stream is a pipe
+static bool source_skip(bmp_source_t *src, size_t len) {
+    if (!src->file) {
+        if (src->size - src->pos < len)
+            return false;
+        src->pos += len;
+        return true;
+    }
+
+    if (len == 0 || (len <= LONG_MAX && fseek(src->file, (long) len, SEEK_CUR) == 0))
+        return true;
+
+    for (; len > 0; --len)
+        if (getc(src->file) == EOF)
+            return false;
+    return true;
+}
+
+static inline bool is_rle24(const bmp_t *bmp) {
+    return bmp->info_header.biCompression == BI_RLE24 &&
+           bmp->info_header.biSize == OS2_INFO_HEADER_SIZE;
+}
+
+static bmp_err_t parse_headers(bmp_t *bmp) {
+    if (bmp->info_header.biWidth <= 0 || bmp->info_header.biHeight == 0 ||
+        bmp->info_header.biHeight == INT32_MIN)
         return BMP_ERR_FILE_READ;
 
+    // Compression 4 with a Windows header is BI_JPEG
+    if (bmp->info_header.biBitCount != BMP_BITS_PER_PIXEL ||
+        (bmp->info_header.biCompression != BI_RGB && !is_rle24(bmp)))
+        return BMP_ERR_UNSUPPORTED_FORMAT;
+
     bmp->size.width = bmp->info_header.biWidth;
     bmp->size.height = abs(bmp->info_header.biHeight);
     bmp->content_size = bmp->info_header.biSizeImage;
 
+    if (is_rle24(bmp)) {
+        // Runs expand to at most RLE_MAX_RUN pixels per 2 encoded bytes. Files
+        // skipping more than that with deltas or early line ends are rejected,
+        // which keeps the decoded allocation proportional to the input.
+        uint64_t max_pixels = (uint64_t) bmp->info_header.biSizeImage / 2 * RLE_MAX_RUN;
+        if ((uint64_t) bmp->size.width * bmp->size.height > max_pixels ||
+            bmp->file_header.bfOffBits < OS2_HEADERS_SIZE)
+            return BMP_ERR_FILE_READ;
+
+        // biSizeImage is the encoded size, keep decoded rows
+        bmp->content_size = calc_bmp_content_size(bmp->size);
+    }
+
     if (bmp->content_size == 0)
         bmp->content_size = calc_bmp_content_size(bmp->size);
 
+    // Rows must hold at least the pixels they are indexed for
+    if (bmp->content_size < calc_bmp_content_size(bmp->size) ||
+        bmp->file_header.bfOffBits < BMP_HEADERS_SIZE)
+        return BMP_ERR_FILE_READ;
+
     return BMP_OK;
 }
 
-static inline bmp_err_t read_pixel_data(bmp_t *bmp, FILE *in_file) {
-    size_t row_size = bmp->content_size / bmp->size.height;
+// Leaves the source right after BITMAPINFOHEADER
+static bmp_err_t read_headers(bmp_t *bmp, bmp_source_t *src) {
+    if (!source_read(src, &bmp->file_header, sizeof(BITMAPFILEHEADER)) ||
+        !source_read(src, &bmp->info_header, sizeof(BITMAPINFOHEADER)))
+        return BMP_ERR_FILE_READ;
 
-    void **data = alloc_2d_array(bmp->size.height, row_size, bmp->content_size);
-    if (!data)
-        return BMP_ERR_MEM_ALLOC;
+    bmp_err_t bmp_err = parse_headers(bmp);
+    if (bmp_err != BMP_OK || src->file)
+        return bmp_err;
+
+    // Whole pixel data must be inside a memory buffer
+    size_t stored_size = is_rle24(bmp) ? bmp->info_header.biSizeImage : bmp->content_size;
+    if (bmp->file_header.bfOffBits > src->size ||
+        src->size - bmp->file_header.bfOffBits < stored_size)
+        return BMP_ERR_FILE_READ;
+
+    return BMP_OK;
+}
+
+static inline bool skip_to_pixel_data(const bmp_t *bmp, bmp_source_t *src) {
+    return source_skip(src, bmp->file_header.bfOffBits - BMP_HEADERS_SIZE);
+}
+
+// Decodes stored rows starting at start_y until the end of the window, one run
+// at a time, so the encoded data is never held in memory. The window is the
+// part of the image at (x0, y0) in stored order having the size of dst.
+// Pixels skipped by deltas or early line ends stay zeroed.
+static bmp_err_t decode_rle24(bmp_t *dst, bmp_size_t size, bmp_source_t *src,
+                              size_t start_y, size_t x0, size_t y0) {
+    size_t x1 = x0 + dst->size.width;
+    size_t y1 = y0 + dst->size.height;
+    size_t x = 0, y = start_y;
+
+    rgb_triple_t run[RLE_MAX_RUN];
+
+    while (y < y1) {
+        int count = source_getc(src);
+        if (count == EOF)
+            return BMP_ERR_FILE_READ;
+
+        // Encoded run repeats one pixel, absolute run is padded to a 16-bit boundary
+        bool encoded = (count > 0);
+        if (!encoded) {
+            int escape = source_getc(src);
+            int dx, dy;
+
+            switch (escape) {
+                case EOF:
+                    return BMP_ERR_FILE_READ;
+                case RLE_END_OF_LINE:
+                    x = 0;
+                    ++y;
+                    continue;
+                case RLE_END_OF_BITMAP:
+                    return BMP_OK;
+                case RLE_DELTA:
+                    if ((dx = source_getc(src)) == EOF || (dy = source_getc(src)) == EOF)
+                        return BMP_ERR_FILE_READ;
+                    x += dx;
+                    y += dy;
+                    continue;
+                default:
+                    count = escape;
+                    break;
+            }
+        }
+
+        size_t stored = encoded ? 1 : (size_t) count;
+
+        if (y >= size.height || x + count > size.width ||
+            !source_read(src, run, stored * sizeof(rgb_triple_t)) ||
+            (!encoded && count % 2 != 0 && source_getc(src) == EOF))
+            return BMP_ERR_FILE_READ;
+
+        if (y >= y0) {
+            size_t from = x > x0 ? x : x0;
+            size_t to = x + count < x1 ? x + count : x1;
+            for (size_t i = from; i < to; ++i)
+                dst->data[y - y0][i - x0] = run[encoded ? 0 : i - x];
+        }
+        x += count;
+    }
+
+    return BMP_OK;
+}
+
+// Reads the strip index, if any, and positions the source at the first run of
+// the strip containing stored row y. Returns the first row of that strip.
+static bool seek_rle24_row(const bmp_t *header, bmp_source_t *src, size_t y, size_t *start_y) {
+    size_t gap = header->file_header.bfOffBits - BMP_HEADERS_SIZE;
+    *start_y = 0;
+
+    RLE_INDEX_HEADER index;
+    size_t strips = 0;
+    if (gap >= OS2_EXTRA_SIZE + sizeof(RLE_INDEX_HEADER)) {
+        if (!source_skip(src, OS2_EXTRA_SIZE) || !source_read(src, &index, sizeof(index)))
+            return false;
+        gap -= OS2_EXTRA_SIZE + sizeof(index);
+
+        if (index.tag == RLE_INDEX_TAG && index.strip_rows != 0 &&
+            index.strips == (header->size.height + index.strip_rows - 1) / index.strip_rows &&
+            gap >= (size_t) index.strips * sizeof(uint32_t))
+            strips = index.strips;
+    }
+
+    if (strips == 0)
+        return source_skip(src, gap);
+
+    size_t strip = y / index.strip_rows;
+    uint32_t offset;
+    if (!source_skip(src, strip * sizeof(uint32_t)) ||
+        !source_read(src, &offset, sizeof(offset)) ||
+        !source_skip(src, gap - (strip + 1) * sizeof(uint32_t)))
+        return false;
+
+    // Only the first strip starts at bfOffBits
+    if ((strip == 0) != (offset == 0))
+        return false;
+
+    if (strip != 0) {
+        uint8_t escape[2];
+        if (offset < sizeof(escape) || offset > header->info_header.biSizeImage ||
+            !source_skip(src, offset - sizeof(escape)) ||
+            !source_read(src, escape, sizeof(escape)) ||
+            escape[0] != 0 || escape[1] != RLE_END_OF_LINE)
+            return false;
+    }
+
+    *start_y = strip * index.strip_rows;
+    return true;
+}
 
-    bmp->data = (rgb_triple_t **) data;
+static bmp_err_t read_pixel_data(bmp_t *bmp, bmp_source_t *src) {
+    if (!skip_to_pixel_data(bmp, src))
+        return BMP_ERR_FILE_READ;
 
-    void *pixel_data = data[0];
-    int io_err = fseek(in_file, bmp->file_header.bfOffBits, SEEK_SET);
+    if (is_rle24(bmp))
+        return decode_rle24(bmp, bmp->size, src, 0, 0, 0);
 
-    if (io_err != 0) {
-        free(data);
+    if (!source_read(src, bmp->data[0], bmp->content_size))
         return BMP_ERR_FILE_READ;
+
+    return BMP_OK;
+}
+
+// Reads only stored rows of the region, skipping the rest without decoding
+static bmp_err_t read_region_data(bmp_t *dst, const bmp_t *header, bmp_source_t *src,
+                                  size_t x0, size_t y0) {
+    if (is_rle24(header)) {
+        size_t start_y;
+        if (!seek_rle24_row(header, src, y0, &start_y))
+            return BMP_ERR_FILE_READ;
+        return decode_rle24(dst, header->size, src, start_y, x0, y0);
     }
 
-    size_t read_items = fread(pixel_data, bmp->content_size, 1, in_file);
-    if (read_items != 1) {
-        free(data);
+    size_t row_size = header->content_size / header->size.height;
+    size_t region_row_size = dst->size.width * sizeof(rgb_triple_t);
+
+    if (!skip_to_pixel_data(header, src) ||
+        !source_skip(src, y0 * row_size + x0 * sizeof(rgb_triple_t)))
         return BMP_ERR_FILE_READ;
+
+    for (size_t row = 0; row < dst->size.height; ++row) {
+        if (!source_read(src, dst->data[row], region_row_size) ||
+            (row + 1 < dst->size.height && !source_skip(src, row_size - region_row_size)))
+            return BMP_ERR_FILE_READ;
     }
 
     return BMP_OK;
 }
 
-#define load_bmp_handle_err(bmp_err) if (bmp_err != BMP_OK) { free(bmp); return bmp_err; }
+bmp_err_t probe_bmp(FILE *in_file, size_t *buf_size) {
+    // Headers are read twice, which pipes and terminals cannot do
+    if (ftell(in_file) < 0 || fseek(in_file, 0, SEEK_SET) != 0)
+        return BMP_ERR_ILLEGAL_ARGS;
 
-bmp_err_t load_bmp(bmp_t **out_bmp, FILE *in_file) {
-    rewind(in_file);
+    bmp_t header;
+    bmp_source_t src = {in_file, NULL, 0, 0};
+    bmp_err_t bmp_err = read_headers(&header, &src);
+    if (fseek(in_file, 0, SEEK_SET) != 0)
+        return BMP_ERR_FILE_READ;
+    if (bmp_err != BMP_OK)
+        return bmp_err;
 
-    *out_bmp = NULL;
-    bmp_t *bmp = malloc(sizeof(bmp_t));
-    if (!bmp)
-        return BMP_ERR_MEM_ALLOC;
+    *buf_size = calc_bmp_block_size(header.size.height, header.content_size);
+    return BMP_OK;
+}
 
-    bmp_err_t bmp_err;
+bmp_err_t probe_bmp_mem(const void *data, size_t data_size, size_t *buf_size) {
+    bmp_t header;
+    bmp_source_t src = {NULL, data, 0, data_size};
+    bmp_err_t bmp_err = read_headers(&header, &src);
+    if (bmp_err != BMP_OK)
+        return bmp_err;
+
+    *buf_size = calc_bmp_block_size(header.size.height, header.content_size);
+    return BMP_OK;
+}
+
+static bmp_err_t load_bmp_impl(bmp_t **out_bmp, bmp_source_t *src, void *buf, size_t buf_size) {
+    *out_bmp = NULL;
+    bmp_t header;
+    bmp_t *bmp;
 
-    bmp_err = read_file_header(bmp, in_file);
-    load_bmp_handle_err(bmp_err)
+    bmp_err_t bmp_err = read_headers(&header, src);
+    if (bmp_err != BMP_OK)
+        return bmp_err;
 
-    bmp_err = read_info_header(bmp, in_file);
-    load_bmp_handle_err(bmp_err)
+    if (buf)
+        bmp_err = place_bmp_into(&bmp, &header, header.content_size, buf, buf_size);
+    else
+        bmp_err = alloc_bmp(&bmp, &header, header.content_size);
+    if (bmp_err != BMP_OK)
+        return bmp_err;
 
-    bmp_err = read_pixel_data(bmp, in_file);
-    load_bmp_handle_err(bmp_err)
+    bmp_err = read_pixel_data(bmp, src);
+    if (bmp_err != BMP_OK) {
+        free_bmp(bmp);
+        return bmp_err;
+    }
 
     *out_bmp = bmp;
     return BMP_OK;
 }
 
-static inline bmp_err_t write_file_header(const bmp_t *bmp, FILE *out_file) {
-    BITMAPFILEHEADER correct_header = bmp->file_header;
+bmp_err_t load_bmp(bmp_t **out_bmp, FILE *in_file) {
+    rewind(in_file);
+    bmp_source_t src = {in_file, NULL, 0, 0};
+    return load_bmp_impl(out_bmp, &src, NULL, 0);
+}
 
-    // Writing pixels right after headers
-    size_t content_pos =
-            sizeof(BITMAPFILEHEADER) +
-            sizeof(BITMAPINFOHEADER);
-    correct_header.bfOffBits = content_pos;
-    correct_header.bfSize = content_pos + bmp->content_size;
-
-    size_t written_items = fwrite(&correct_header, sizeof(BITMAPFILEHEADER), 1, out_file);
-    if (written_items != 1)
-        return BMP_ERR_FILE_WRITE;
-    return BMP_OK;
+bmp_err_t load_bmp_into(bmp_t **out_bmp, FILE *in_file, void *buf, size_t buf_size) {
+    if (!buf)
+        return BMP_ERR_ILLEGAL_ARGS;
+
+    rewind(in_file);
+    bmp_source_t src = {in_file, NULL, 0, 0};
+    return load_bmp_impl(out_bmp, &src, buf, buf_size);
 }
 
-static inline bmp_err_t write_info_header(const bmp_t *bmp, FILE *out_file) {
-    BITMAPINFOHEADER correct_header = bmp->info_header;
+bmp_err_t load_bmp_mem(bmp_t **out_bmp, const void *data, size_t data_size) {
+    bmp_source_t src = {NULL, data, 0, data_size};
+    return load_bmp_impl(out_bmp, &src, NULL, 0);
+}
 
-    correct_header.biHeight = bmp->size.height;
-    correct_header.biWidth = bmp->size.width;
-    correct_header.biSizeImage = bmp->content_size;
+bmp_err_t load_bmp_mem_into(bmp_t **out_bmp, const void *data, size_t data_size,
+                            void *buf, size_t buf_size) {
+    if (!buf)
+        return BMP_ERR_ILLEGAL_ARGS;
 
-    size_t written_items = fwrite(&correct_header, sizeof(BITMAPINFOHEADER), 1, out_file);
-    if (written_items != 1)
-        return BMP_ERR_FILE_WRITE;
-    return BMP_OK;
+    bmp_source_t src = {NULL, data, 0, data_size};
+    return load_bmp_impl(out_bmp, &src, buf, buf_size);
 }
 
-static inline bmp_err_t write_pixel_data(const bmp_t *bmp, FILE *out_file) {
-    void *pixel_data = bmp->data[0];
+static bmp_err_t load_bmp_region_impl(bmp_t **out_dst, bmp_source_t *src, bmp_rect_t region) {
+    *out_dst = NULL;
+    bmp_t header;
+    bmp_t *dst;
 
-    size_t written_items = fwrite(pixel_data, bmp->content_size, 1, out_file);
-    if (written_items != 1)
-        return BMP_ERR_FILE_WRITE;
+    bmp_err_t bmp_err = read_headers(&header, src);
+    if (bmp_err != BMP_OK)
+        return bmp_err;
+
+    if (!region_in_bounds(header.size, region))
+        return BMP_ERR_ILLEGAL_ARGS;
+
+    bmp_err = create_bmp_with_size(&dst, &header, region.size, NULL, 0);
+    if (bmp_err != BMP_OK)
+        return bmp_err;
+
+    // Convert top-down to bottom-up positioning
+    size_t y0 = header.size.height - region.pos.y - region.size.height;
+
+    bmp_err = read_region_data(dst, &header, src, region.pos.x, y0);
+    if (bmp_err != BMP_OK) {
+        free_bmp(dst);
+        return bmp_err;
+    }
 
+    *out_dst = dst;
     return BMP_OK;
 }
 
-bmp_err_t save_bmp(const bmp_t *bmp, FILE *out_file) {
+bmp_err_t load_bmp_region(bmp_t **out_dst, FILE *in_file, bmp_rect_t region) {
+    rewind(in_file);
+    bmp_source_t src = {in_file, NULL, 0, 0};
+    return load_bmp_region_impl(out_dst, &src, region);
+}
+
+bmp_err_t load_bmp_mem_region(bmp_t **out_dst, const void *data, size_t data_size,
+                              bmp_rect_t region) {
+    bmp_source_t src = {NULL, data, 0, data_size};
+    return load_bmp_region_impl(out_dst, &src, region);
+}
+
+// Output for headers and encoded pixels. Without data it only counts bytes,
+// with a file it flushes the buffer there once full, otherwise it fails.
+typedef struct {
+    uint8_t *data;
+    size_t pos, size;
+    FILE *file;
+    size_t total;
+} bmp_sink_t;
+
+static bool sink_flush(bmp_sink_t *sink) {
+    if (sink->pos != 0 && fwrite(sink->data, sink->pos, 1, sink->file) != 1)
+        return false;
+    sink->pos = 0;
+    return true;
+}
+
+static bool sink_write(bmp_sink_t *sink, const void *src, size_t len) {
+    sink->total += len;
+    if (!sink->data)
+        return true;
+
+    const uint8_t *bytes = (const uint8_t *) src;
+    while (len > 0) {
+        if (sink->pos == sink->size && !(sink->file && sink_flush(sink)))
+            return false;
+
+        size_t chunk = sink->size - sink->pos;
+        if (chunk > len)
+            chunk = len;
+
+        memcpy(sink->data + sink->pos, bytes, chunk);
+        sink->pos += chunk;
+        bytes += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+static inline bool sink_put_pair(bmp_sink_t *sink, uint8_t first, uint8_t second) {
+    uint8_t pair[2] = {first, second};
+    return sink_write(sink, pair, sizeof(pair));
+}
+
+static inline bool sink_put_run(bmp_sink_t *sink, size_t count, const rgb_triple_t *pxl) {
+    uint8_t count_byte = (uint8_t) count;
+    return sink_write(sink, &count_byte, 1) && sink_write(sink, pxl, sizeof(rgb_triple_t));
+}
+
+static inline bool same_pixels(const rgb_triple_t *a, const rgb_triple_t *b) {
+    return a->r == b->r && a->g == b->g && a->b == b->b;
+}
+
+static bool encode_rle24_row(const rgb_triple_t *row, size_t width, bmp_sink_t *sink) {
+    size_t x = 0;
+
+    while (x < width) {
+        size_t run = 1;
+        while (x + run < width && run < RLE_MAX_RUN && same_pixels(&row[x], &row[x + run]))
+            ++run;
+
+        if (run > 1) {
+            if (!sink_put_run(sink, run, &row[x]))
+                return false;
+            x += run;
+            continue;
+        }
+
+        // Gather literals up to the start of the next repeated pixel
+        size_t literals = 1;
+        while (x + literals < width && literals < RLE_MAX_RUN &&
+               (x + literals + 1 == width || !same_pixels(&row[x + literals], &row[x + literals + 1])))
+            ++literals;
+
+        if (literals < RLE_MIN_ABSOLUTE) {
+            // Absolute mode cannot hold that few pixels
+            for (size_t i = 0; i < literals; ++i)
+                if (!sink_put_run(sink, 1, &row[x + i]))
+                    return false;
+        } else {
+            uint8_t pad = 0;
+            if (!sink_put_pair(sink, 0, (uint8_t) literals) ||
+                !sink_write(sink, &row[x], literals * sizeof(rgb_triple_t)) ||
+                (literals % 2 != 0 && !sink_write(sink, &pad, 1)))
+                return false;
+        }
+        x += literals;
+    }
+
+    return true;
+}
+
+// Every row ends with a line end, so decoding may start at any row.
+// With offsets set, the offset of every strip is stored there.
+static bool encode_rle24(const bmp_t *bmp, bmp_sink_t *sink, uint32_t *offsets) {
+    size_t start = sink->total;
+
+    for (size_t y = 0; y < bmp->size.height; ++y) {
+        if (offsets && y % RLE_STRIP_ROWS == 0)
+            offsets[y / RLE_STRIP_ROWS] = (uint32_t) (sink->total - start);
+
+        if (!encode_rle24_row(bmp->data[y], bmp->size.width, sink))
+            return false;
+
+        bool last = (y + 1 == bmp->size.height);
+        if (!sink_put_pair(sink, 0, last ? RLE_END_OF_BITMAP : RLE_END_OF_LINE))
+            return false;
+    }
+    return true;
+}
+
+static inline size_t calc_rle24_strips(bmp_size_t size) {
+    return (size.height + RLE_STRIP_ROWS - 1) / RLE_STRIP_ROWS;
+}
+
+static size_t calc_pixel_data_offset(const bmp_t *bmp, bmp_enc_t enc) {
+    if (enc == BMP_ENC_RLE24)
+        return OS2_HEADERS_SIZE + sizeof(RLE_INDEX_HEADER) +
+               calc_rle24_strips(bmp->size) * sizeof(uint32_t);
+    return BMP_HEADERS_SIZE;
+}
+
+static size_t calc_pixel_data_size(const bmp_t *bmp, bmp_enc_t enc) {
+    if (enc != BMP_ENC_RLE24)
+        return bmp->content_size;
+
+    bmp_sink_t counter = {NULL, 0, 0, NULL, 0};
+    encode_rle24(bmp, &counter, NULL);
+    return counter.total;
+}
+
+size_t bmp_file_size_enc(const bmp_t *bmp, bmp_enc_t enc) {
+    return calc_pixel_data_offset(bmp, enc) + calc_pixel_data_size(bmp, enc);
+}
+
+size_t bmp_file_size(const bmp_t *bmp) {
+    return bmp_file_size_enc(bmp, BMP_ENC_RGB);
+}
+
+// Returns sink_err when the sink fails
+static bmp_err_t write_bmp(const bmp_t *bmp, bmp_enc_t enc, bmp_sink_t *sink, bmp_err_t sink_err) {
+    size_t pixel_data_offset = calc_pixel_data_offset(bmp, enc);
+    size_t pixel_data_size = bmp->content_size;
+
+    // One counting pass gives both the strip offsets and the encoded size,
+    // pixels are encoded for real once headers and offsets are written
+    size_t strips = calc_rle24_strips(bmp->size);
+    uint32_t *offsets = NULL;
+    if (enc == BMP_ENC_RLE24) {
+        offsets = malloc(strips * sizeof(uint32_t));
+        if (!offsets)
+            return BMP_ERR_MEM_ALLOC;
+
+        bmp_sink_t counter = {NULL, 0, 0, NULL, 0};
+        encode_rle24(bmp, &counter, offsets);
+        pixel_data_size = counter.total;
+    }
+
+    BITMAPFILEHEADER file_header = bmp->file_header;
+
+    // Writing pixels right after headers
+    file_header.bfOffBits = pixel_data_offset;
+    file_header.bfSize = pixel_data_offset + pixel_data_size;
+
+    BITMAPINFOHEADER info_header = bmp->info_header;
+
+    info_header.biHeight = bmp->size.height;
+    info_header.biWidth = bmp->size.width;
+    info_header.biSizeImage = pixel_data_size;
+
+    bool written;
+    if (enc != BMP_ENC_RLE24) {
+        info_header.biSize = sizeof(BITMAPINFOHEADER);
+        info_header.biCompression = BI_RGB;
+
+        written = sink_write(sink, &file_header, sizeof(BITMAPFILEHEADER)) &&
+                  sink_write(sink, &info_header, sizeof(BITMAPINFOHEADER)) &&
+                  sink_write(sink, bmp->data[0], bmp->content_size);
+    } else {
+        info_header.biSize = OS2_INFO_HEADER_SIZE;
+        info_header.biCompression = BI_RLE24;
+
+        uint8_t os2_extra[OS2_EXTRA_SIZE] = {0};
+        RLE_INDEX_HEADER index = {RLE_INDEX_TAG, RLE_STRIP_ROWS, (uint32_t) strips};
+
+        written = sink_write(sink, &file_header, sizeof(BITMAPFILEHEADER)) &&
+                  sink_write(sink, &info_header, sizeof(BITMAPINFOHEADER)) &&
+                  sink_write(sink, os2_extra, sizeof(os2_extra)) &&
+                  sink_write(sink, &index, sizeof(index)) &&
+                  sink_write(sink, offsets, strips * sizeof(uint32_t)) &&
+                  encode_rle24(bmp, sink, NULL);
+        free(offsets);
+    }
+
+    return written ? BMP_OK : sink_err;
+}
+
+bmp_err_t save_bmp_enc(const bmp_t *bmp, FILE *out_file, bmp_enc_t enc) {
+    if (enc != BMP_ENC_RGB && enc != BMP_ENC_RLE24)
+        return BMP_ERR_ILLEGAL_ARGS;
+
     // Ensuring we are at the beginning
     rewind(out_file);
 
-    bmp_err_t bmp_err;
-
-    bmp_err = write_file_header(bmp, out_file);
-    if (bmp_err != BMP_OK) return bmp_err;
+    uint8_t chunk[BMP_SINK_CHUNK];
+    bmp_sink_t sink = {chunk, 0, sizeof(chunk), out_file, 0};
 
-    bmp_err = write_info_header(bmp, out_file);
-    if (bmp_err != BMP_OK) return bmp_err;
+    bmp_err_t bmp_err = write_bmp(bmp, enc, &sink, BMP_ERR_FILE_WRITE);
+    if (bmp_err != BMP_OK)
+        return bmp_err;
 
-    bmp_err = write_pixel_data(bmp, out_file);
-    if (bmp_err != BMP_OK) return bmp_err;
+    if (!sink_flush(&sink))
+        return BMP_ERR_FILE_WRITE;
 
     int io_err = fflush(out_file);
     if (io_err != 0)
@@ -192,46 +750,47 @@ bmp_err_t save_bmp(const bmp_t *bmp, FILE *out_file) {
     return BMP_OK;
 }
 
-void free_bmp(bmp_t *bmp) {
-    free(bmp->data);
-    free(bmp);
+bmp_err_t save_bmp(const bmp_t *bmp, FILE *out_file) {
+    return save_bmp_enc(bmp, out_file, BMP_ENC_RGB);
 }
 
-static inline bmp_err_t create_bmp_with_size(bmp_t **dst, const bmp_t *ref, bmp_size_t size) {
-    bmp_t *bmp = malloc(sizeof(bmp_t));
-    if (!bmp)
-        return BMP_ERR_MEM_ALLOC;
+bmp_err_t save_bmp_mem_enc(const bmp_t *bmp, void *data, size_t data_size,
+                           bmp_enc_t enc, size_t *written) {
+    if (enc != BMP_ENC_RGB && enc != BMP_ENC_RLE24)
+        return BMP_ERR_ILLEGAL_ARGS;
 
-    *bmp = *ref;
+    bmp_sink_t sink = {(uint8_t *) data, 0, data_size, NULL, 0};
+    bmp_err_t bmp_err = write_bmp(bmp, enc, &sink, BMP_ERR_ILLEGAL_ARGS);
+    if (bmp_err != BMP_OK)
+        return bmp_err;
 
-    bmp->size = size;
-    bmp->content_size = calc_bmp_content_size(size);
+    *written = sink.total;
+    return BMP_OK;
+}
 
-    size_t row_size = bmp->content_size / size.height;
-    bmp->data = (rgb_triple_t **) alloc_2d_array(size.height, row_size, bmp->content_size);
-    if (!bmp->data) {
-        free(bmp);
-        return BMP_ERR_MEM_ALLOC;
-    }
+bmp_err_t save_bmp_mem(const bmp_t *bmp, void *data, size_t data_size) {
+    size_t written;
+    return save_bmp_mem_enc(bmp, data, data_size, BMP_ENC_RGB, &written);
+}
 
-    *dst = bmp;
-    return BMP_OK;
+void free_bmp(bmp_t *bmp) {
+    if (bmp->owns_memory)
+        free(bmp);
 }
 
-bmp_err_t crop_bmp(bmp_t **out_dst, const bmp_t *src, bmp_rect_t region) {
+static bmp_err_t crop_bmp_impl(bmp_t **out_dst, const bmp_t *src, bmp_rect_t region,
+                               void *buf, size_t buf_size) {
     *out_dst = NULL;
     bmp_err_t bmp_err;
 
-    if (region.pos.x < 0 || region.pos.y < 0 ||
-        region.pos.x + region.size.width > src->size.width ||
-        region.pos.y + region.size.height > src->size.height)
+    if (!region_in_bounds(src->size, region))
         return BMP_ERR_ILLEGAL_ARGS;
 
     // Convert top-down to bottom-up positioning
     region.pos.y = src->size.height - region.pos.y - region.size.height;
 
     bmp_t *dst;
-    bmp_err = create_bmp_with_size(&dst, src, region.size);
+    bmp_err = create_bmp_with_size(&dst, src, region.size, buf, buf_size);
     if (bmp_err != BMP_OK)
         return bmp_err;
 
@@ -243,20 +802,40 @@ bmp_err_t crop_bmp(bmp_t **out_dst, const bmp_t *src, bmp_rect_t region) {
     return BMP_OK;
 }
 
-bmp_err_t clone_image(bmp_t **out_dst, const bmp_t *src) {
+bmp_err_t crop_bmp(bmp_t **out_dst, const bmp_t *src, bmp_rect_t region) {
+    return crop_bmp_impl(out_dst, src, region, NULL, 0);
+}
+
+bmp_err_t crop_bmp_into(bmp_t **out_dst, const bmp_t *src, bmp_rect_t region,
+                        void *buf, size_t buf_size) {
+    if (!buf)
+        return BMP_ERR_ILLEGAL_ARGS;
+    return crop_bmp_impl(out_dst, src, region, buf, buf_size);
+}
+
+static bmp_err_t clone_image_impl(bmp_t **out_dst, const bmp_t *src, void *buf, size_t buf_size) {
     *out_dst = NULL;
     bmp_t *dst;
 
-    bmp_err_t bmp_err = create_bmp_with_size(&dst, src, src->size);
+    bmp_err_t bmp_err = create_bmp_with_size(&dst, src, src->size, buf, buf_size);
     if (bmp_err != BMP_OK)
         return bmp_err;
 
-    memcpy(dst->data, src->data, src->content_size);
+    // Source rows may be wider when biSizeImage carries extra bytes
+    size_t row_size = dst->content_size / dst->size.height;
+    for (size_t row = 0; row < src->size.height; ++row)
+        memcpy(dst->data[row], src->data[row], row_size);
+
     *out_dst = dst;
     return BMP_OK;
 }
 
-static inline bmp_err_t rotate_bmp_clockwise_90(bmp_t **out_dst, const bmp_t *src) {
+bmp_err_t clone_image(bmp_t **out_dst, const bmp_t *src) {
+    return clone_image_impl(out_dst, src, NULL, 0);
+}
+
+static inline bmp_err_t rotate_bmp_clockwise_90(bmp_t **out_dst, const bmp_t *src,
+                                                void *buf, size_t buf_size) {
     *out_dst = NULL;
     bmp_t *dst;
 
@@ -264,7 +843,7 @@ static inline bmp_err_t rotate_bmp_clockwise_90(bmp_t **out_dst, const bmp_t *sr
     rot_size.width = src->size.height;
     rot_size.height = src->size.width;
 
-    bmp_err_t bmp_err = create_bmp_with_size(&dst, src, rot_size);
+    bmp_err_t bmp_err = create_bmp_with_size(&dst, src, rot_size, buf, buf_size);
     if (bmp_err != BMP_OK)
         return bmp_err;
 
@@ -276,17 +855,29 @@ static inline bmp_err_t rotate_bmp_clockwise_90(bmp_t **out_dst, const bmp_t *sr
     return BMP_OK;
 }
 
-bmp_err_t rotate_bmp(bmp_t **dst, const bmp_t *src, bmp_rot_t rot) {
+static bmp_err_t rotate_bmp_impl(bmp_t **dst, const bmp_t *src, bmp_rot_t rot,
+                                 void *buf, size_t buf_size) {
     switch (rot) {
         case BMP_ROT_NONE:
-            return clone_image(dst, src);
+            return clone_image_impl(dst, src, buf, buf_size);
         case BMP_ROT_CLOCKWISE_90:
-            return rotate_bmp_clockwise_90(dst, src);
+            return rotate_bmp_clockwise_90(dst, src, buf, buf_size);
         default:
             return BMP_ERR_ILLEGAL_ARGS;
     }
 }
 
+bmp_err_t rotate_bmp(bmp_t **dst, const bmp_t *src, bmp_rot_t rot) {
+    return rotate_bmp_impl(dst, src, rot, NULL, 0);
+}
+
+bmp_err_t rotate_bmp_into(bmp_t **dst, const bmp_t *src, bmp_rot_t rot,
+                          void *buf, size_t buf_size) {
+    if (!buf)
+        return BMP_ERR_ILLEGAL_ARGS;
+    return rotate_bmp_impl(dst, src, rot, buf, buf_size);
+}
+
 bmp_err_t get_pixel_in_bmp(const bmp_t *bmp, bmp_pos_t pos, rgb_triple_t **pxl) {
     if (pos.x < 0 || pos.y < 0 ||
         (uint32_t) pos.x >= bmp->size.width ||
@@ -299,4 +890,8 @@ bmp_err_t get_pixel_in_bmp(const bmp_t *bmp, bmp_pos_t pos, rgb_triple_t **pxl)
     *pxl = &bmp->data[pos.y][pos.x];
 
     return BMP_OK;
-}
\ No newline at end of file
+}
+
+bmp_size_t get_bmp_size(const bmp_t *bmp) {
+    return bmp->size;
+}
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 static void print_bmp_err_msg(bmp_err_t bmp_err) {
     switch (bmp_err) {
@@ -19,6 +20,9 @@ static void print_bmp_err_msg(bmp_err_t bmp_err) {
         case BMP_ERR_FILE_WRITE:
             fprintf(stderr, "An error occurred during writing to output file.\n");
             break;
+        case BMP_ERR_UNSUPPORTED_FORMAT:
+            fprintf(stderr, "Input file uses an unsupported bmp format.\n");
+            break;
         default:
             break;
     }
@@ -38,14 +42,29 @@ static void print_stego_err_msg(stego_err_t stego_err) {
         case STEGO_ERR_WRITE_MSG:
             fprintf(stderr, "An error occurred during writing to message file.\n");
             break;
+        case STEGO_ERR_KEY_COLLISION:
+            fprintf(stderr, "Key uses the same pixel channel more than once.\n");
+            break;
+        case STEGO_ERR_MEM_ALLOC:
+            fprintf(stderr, "An error occurred during memory allocation.\n");
+            break;
         default:
             break;
     }
 }
 
+static inline bool is_std_stream_name(const char *file_name) {
+    return strcmp(file_name, "-") == 0;
+}
+
+// "-" stands for stdin or stdout depending on mode
 static int open_file(const char *file_name, const char *readable_name,
                      const char *mode, FILE **in_file) {
-    *in_file = fopen(file_name, mode);
+    if (is_std_stream_name(file_name))
+        *in_file = (mode[0] == 'r') ? stdin : stdout;
+    else
+        *in_file = fopen(file_name, mode);
+
     if (!*in_file) {
         fprintf(stderr, "Could not open %s file.\n", readable_name);
         return 1;
@@ -53,16 +72,50 @@ static int open_file(const char *file_name, const char *readable_name,
     return 0;
 }
 
+static void close_file(FILE *file) {
+    if (file && file != stdin && file != stdout)
+        fclose(file);
+}
+
+static int check_single_stdin(int names_amount, char **file_names) {
+    int stdin_users = 0;
+    for (int i = 0; i < names_amount; ++i)
+        stdin_users += is_std_stream_name(file_names[i]);
+
+    if (stdin_users > 1) {
+        fprintf(stderr, "Only one input file can be read from stdin.\n");
+        return 1;
+    }
+    return 0;
+}
+
 #define catch_bmp_err(bmp_err) if (bmp_err != BMP_OK) { print_bmp_err_msg(bmp_err); goto error; }
 
 #define catch_stego_err(stego_err) if (stego_err != STEGO_OK) { print_stego_err_msg(stego_err); goto error; }
 
+static int parse_encoding(const char *name, bmp_enc_t *enc) {
+    if (strcmp(name, "rgb") == 0)
+        *enc = BMP_ENC_RGB;
+    else if (strcmp(name, "rle") == 0)
+        *enc = BMP_ENC_RLE24;
+    else {
+        fprintf(stderr, "Unknown output encoding.\n");
+        return 1;
+    }
+    return 0;
+}
+
 static int crop_rotate(int argc, char **argv) {
-    if (argc != 8) {
+    if (argc != 8 && argc != 9) {
         fprintf(stderr, "Wrong number of arguments for crop_rotate.\n");
         return 1;
     }
 
+    // Optional trailing argument selects output encoding
+    bmp_enc_t enc = BMP_ENC_RGB;
+    if (argc == 9 && parse_encoding(argv[8], &enc) != 0)
+        return 1;
+
     char *in_file_name = argv[2];
     char *out_file_name = argv[3];
 
@@ -74,7 +127,6 @@ static int crop_rotate(int argc, char **argv) {
     crop_rect.size.width = atoi(argv[6]);
     crop_rect.size.height = atoi(argv[7]);
 
-    bmp_t *orig = NULL;
     bmp_t *cropped = NULL;
     bmp_t *rotated = NULL;
 
@@ -84,8 +136,7 @@ static int crop_rotate(int argc, char **argv) {
     if (open_file(in_file_name, "input", "rb", &in_file) != 0)
         goto error;
 
-    if ((bmp_err = load_bmp(&orig, in_file)) != BMP_OK ||
-        (bmp_err = crop_bmp(&cropped, orig, crop_rect)) != BMP_OK ||
+    if ((bmp_err = load_bmp_region(&cropped, in_file, crop_rect)) != BMP_OK ||
         (bmp_err = rotate_bmp(&rotated, cropped, BMP_ROT_CLOCKWISE_90)) != BMP_OK) {
 
         print_bmp_err_msg(bmp_err);
@@ -96,7 +147,7 @@ static int crop_rotate(int argc, char **argv) {
         goto error;
     }
 
-    if ((bmp_err = save_bmp(rotated, out_file)) != BMP_OK) {
+    if ((bmp_err = save_bmp_enc(rotated, out_file, enc)) != BMP_OK) {
         print_bmp_err_msg(bmp_err);
         goto error;
     }
@@ -108,9 +159,8 @@ static int crop_rotate(int argc, char **argv) {
         err_code = 1;
 
     clear:
-        if (in_file)  fclose(in_file);
-        if (out_file) fclose(out_file);
-        if (orig)     free_bmp(orig);
+        close_file(in_file);
+        close_file(out_file);
         if (cropped)  free_bmp(cropped);
         if (rotated)  free_bmp(rotated);
 
@@ -136,6 +186,10 @@ static int insert(int argc, char **argv) {
     FILE *key_file = NULL;
     FILE *msg_file = NULL;
 
+    char *input_names[] = {in_file_name, key_file_name, msg_file_name};
+    if (check_single_stdin(3, input_names) != 0)
+        return 1;
+
     if (open_file(in_file_name, "input", "rb", &in_file) != 0 ||
         open_file(key_file_name, "key", "rb", &key_file) != 0 ||
         open_file(msg_file_name, "msg", "rb", &msg_file) != 0 ||
@@ -159,10 +213,10 @@ static int insert(int argc, char **argv) {
 
     clear:
         if (bmp)      free_bmp(bmp);
-        if (in_file)  fclose(in_file);
-        if (out_file) fclose(out_file);
-        if (key_file) fclose(key_file);
-        if (msg_file) fclose(msg_file);
+        close_file(in_file);
+        close_file(out_file);
+        close_file(key_file);
+        close_file(msg_file);
 
     return err_code;
 }
@@ -183,6 +237,10 @@ static int extract(int argc, char **argv) {
     FILE *key_file = NULL;
     FILE *msg_file = NULL;
 
+    char *input_names[] = {in_file_name, key_file_name};
+    if (check_single_stdin(2, input_names) != 0)
+        return 1;
+
     if (open_file(in_file_name, "input", "rb", &in_file) != 0 ||
         open_file(key_file_name, "key", "rb", &key_file) != 0 ||
         open_file(msg_file_name, "msg", "wb", &msg_file) != 0)
@@ -202,18 +260,66 @@ static int extract(int argc, char **argv) {
 
     clear:
         if (bmp)      free_bmp(bmp);
-        if (in_file)  fclose(in_file);
-        if (key_file) fclose(key_file);
-        if (msg_file) fclose(msg_file);
+        close_file(in_file);
+        close_file(key_file);
+        close_file(msg_file);
 
     return err_code;
 }
 
+static int analyze_key_action(int argc, char **argv) {
+    if (argc != 4) {
+        fprintf(stderr, "Wrong number of arguments for analyze-key.\n");
+        return 1;
+    }
+    char *in_file_name = argv[2];
+    char *key_file_name = argv[3];
+
+    bmp_err_t bmp_err;
+    bmp_t *bmp = NULL;
+
+    FILE *in_file = NULL;
+    FILE *key_file = NULL;
+
+    char *input_names[] = {in_file_name, key_file_name};
+    if (check_single_stdin(2, input_names) != 0)
+        return 1;
+
+    if (open_file(in_file_name, "input", "rb", &in_file) != 0 ||
+        open_file(key_file_name, "key", "rb", &key_file) != 0)
+        goto error;
+
+    bmp_err = load_bmp(&bmp, in_file);
+    catch_bmp_err(bmp_err)
+
+    stego_key_stats_t stats;
+    stego_err_t stego_err = analyze_key(bmp, key_file, &stats);
+    catch_stego_err(stego_err)
+
+    printf("entries: %zu\n", stats.entries);
+    printf("out of bounds: %zu\n", stats.out_of_bounds);
+    printf("duplicates: %zu\n", stats.duplicates);
+    printf("malformed: %s\n", stats.malformed ? "yes" : "no");
+    printf("capacity: %zu letters\n", stats.capacity);
+
+    int err_code = 0;
+    goto clear;
+
+    error:
+        err_code = 1;
+
+    clear:
+        if (bmp)      free_bmp(bmp);
+        close_file(in_file);
+        close_file(key_file);
+
+    return err_code;
+}
 
 typedef int (*action_function_p)(int argc, char *argv[]);
-const char *actions[] = {"crop-rotate", "insert", "extract"};
+const char *actions[] = {"crop-rotate", "insert", "extract", "analyze-key"};
 const action_function_p action_functions[] = 
-            {&crop_rotate, &insert, &extract};
+            {&crop_rotate, &insert, &extract, &analyze_key_action};
 const int actions_amount = sizeof(actions) / sizeof(char*);
 
 int main(int argc, char **argv) {
@@ -1,10 +1,14 @@
 #include "stego.h"
 
+#include <limits.h>
+#include <stdlib.h>
+
 
 #define BITS_PER_LETTER 5
-#define LETTER_LUT_SIZE 30
+// Every 5-bit code and every byte have an entry, unknown ones map to '\0'
+#define LETTER_LUT_SIZE (1 << BITS_PER_LETTER)
 static char letter_decoding_lut[LETTER_LUT_SIZE];
-static int letter_encoding_lut[127];
+static int letter_encoding_lut[UCHAR_MAX + 1];
 
 void init_stego(void) {
     letter_encoding_lut[(int) '\0'] = 0;
@@ -18,13 +22,13 @@ void init_stego(void) {
     char add_chs[] = {' ', '.', ','};
     for (int i = 0; i < 3; ++i) {
         char c = add_chs[i];
-        letter_encoding_lut[(int) c] = 1 + latin + i;
+        letter_encoding_lut[(unsigned char) c] = 1 + latin + i;
         letter_decoding_lut[1 + latin + i] = c;
     }
 }
 
 static inline int encode_letter(char c) {
-    return letter_encoding_lut[(int) c];
+    return letter_encoding_lut[(unsigned char) c];
 }
 
 static inline char decode_letter(int i) {
@@ -69,11 +73,96 @@ stego_err_t get_bit_from_bmp(const bmp_t *src, bmp_pos_t pos, bmp_channel_t chan
 
 
 
-static int read_key_row(FILE *key_file, bmp_pos_t *pos, bmp_channel_t *channel) {
-    char ch;
-    if (fscanf(key_file, "%d %d %c", &pos->x, &pos->y, &ch) != 3)
+#define STEGO_IO_BUF_SIZE (64 * 1024)
+
+// Buffers live on the heap to keep stack usage small for library callers
+typedef struct {
+    FILE *file;
+    size_t pos, len;
+    char *buf;
+} stego_reader_t;
+
+typedef struct {
+    FILE *file;
+    size_t len;
+    char *buf;
+} stego_writer_t;
+
+static inline stego_err_t init_reader(stego_reader_t *reader, FILE *file) {
+    reader->file = file;
+    reader->pos = 0;
+    reader->len = 0;
+    reader->buf = malloc(STEGO_IO_BUF_SIZE);
+    return reader->buf ? STEGO_OK : STEGO_ERR_MEM_ALLOC;
+}
+
+static inline stego_err_t init_writer(stego_writer_t *writer, FILE *file) {
+    writer->file = file;
+    writer->len = 0;
+    writer->buf = malloc(STEGO_IO_BUF_SIZE);
+    return writer->buf ? STEGO_OK : STEGO_ERR_MEM_ALLOC;
+}
+
+static inline bool fill_reader(stego_reader_t *reader) {
+    reader->pos = 0;
+    reader->len = fread(reader->buf, 1, STEGO_IO_BUF_SIZE, reader->file);
+    return reader->len != 0;
+}
+
+// Returns EOF when the underlying file is exhausted, like getc.
+static inline int peek_char(stego_reader_t *reader) {
+    if (reader->pos == reader->len && !fill_reader(reader))
+        return EOF;
+    return (unsigned char) reader->buf[reader->pos];
+}
+
+static inline void skip_spaces(stego_reader_t *reader) {
+    int ch;
+    while ((ch = peek_char(reader)) == ' ' || (ch >= '\t' && ch <= '\r'))
+        ++reader->pos;
+}
+
+static int read_key_int(stego_reader_t *reader, int32_t *value) {
+    skip_spaces(reader);
+
+    bool negative = false;
+    int ch = peek_char(reader);
+    if (ch == '-' || ch == '+') {
+        negative = (ch == '-');
+        ++reader->pos;
+        ch = peek_char(reader);
+    }
+
+    if (ch < '0' || ch > '9')
+        return 1;
+
+    int64_t result = 0;
+    for (; ch >= '0' && ch <= '9'; ch = peek_char(reader)) {
+        if (result <= INT32_MAX)
+            result = result * 10 + (ch - '0');
+        ++reader->pos;
+    }
+
+    // Clamp overflowing values. INT32_MAX is never a valid coordinate
+    // as image sides are at most INT32_MAX, and negatives never are.
+    if (result > INT32_MAX)
+        result = INT32_MAX;
+
+    *value = (int32_t) (negative ? -result : result);
+    return 0;
+}
+
+static int read_key_row(stego_reader_t *reader, bmp_pos_t *pos, bmp_channel_t *channel) {
+    if (read_key_int(reader, &pos->x) != 0 ||
+        read_key_int(reader, &pos->y) != 0)
         return 1;
 
+    skip_spaces(reader);
+    int ch = peek_char(reader);
+    if (ch == EOF)
+        return 1;
+    ++reader->pos;
+
     switch (ch) {
         case 'R':
             (*channel) = BMP_CHANNEL_R;
@@ -90,7 +179,99 @@ static int read_key_row(FILE *key_file, bmp_pos_t *pos, bmp_channel_t *channel)
     return 0;
 }
 
-static stego_err_t put_letter_in_bmp(bmp_t *bmp, FILE *key_file, int letter) {
+static inline int flush_writer(stego_writer_t *writer) {
+    if (writer->len != 0 && fwrite(writer->buf, 1, writer->len, writer->file) != writer->len)
+        return 1;
+    writer->len = 0;
+    return 0;
+}
+
+static inline int write_char(stego_writer_t *writer, char ch) {
+    if (writer->len == STEGO_IO_BUF_SIZE && flush_writer(writer) != 0)
+        return 1;
+    writer->buf[writer->len++] = ch;
+    return 0;
+}
+
+typedef struct {
+    bmp_size_t size;
+    uint64_t *slots; // One bit per pixel channel
+    uint64_t *saved; // Original low bits of used slots, to roll an insert back
+} stego_key_index_t;
+
+#define CHANNELS_PER_PIXEL 3
+#define SLOTS_PER_WORD 64
+
+static stego_err_t init_key_index(stego_key_index_t *index, const bmp_t *bmp) {
+    index->size = get_bmp_size(bmp);
+
+    size_t slots = (size_t) index->size.width * index->size.height * CHANNELS_PER_PIXEL;
+    size_t words = slots / SLOTS_PER_WORD + 1;
+
+    index->slots = calloc(2 * words, sizeof(uint64_t));
+    if (!index->slots)
+        return STEGO_ERR_MEM_ALLOC;
+    index->saved = index->slots + words;
+
+    return STEGO_OK;
+}
+
+static inline void free_key_index(stego_key_index_t *index) {
+    free(index->slots);
+}
+
+static inline bool key_row_in_bounds(const stego_key_index_t *index, bmp_pos_t pos) {
+    return pos.x >= 0 && pos.y >= 0 &&
+           (uint32_t) pos.x < index->size.width &&
+           (uint32_t) pos.y < index->size.height;
+}
+
+static inline size_t key_slot(const stego_key_index_t *index, bmp_pos_t pos, bmp_channel_t channel) {
+    return ((size_t) pos.y * index->size.width + pos.x) * CHANNELS_PER_PIXEL + channel;
+}
+
+// Marks the slot of an in-bounds row as used, returns whether it was used before
+static inline bool test_and_set_slot(stego_key_index_t *index, bmp_pos_t pos, bmp_channel_t channel) {
+    size_t slot = key_slot(index, pos, channel);
+
+    uint64_t *word = &index->slots[slot / SLOTS_PER_WORD];
+    uint64_t mask = (uint64_t) 1 << (slot % SLOTS_PER_WORD);
+
+    bool used = (*word & mask) != 0;
+    *word |= mask;
+    return used;
+}
+
+static inline void save_slot_bit(stego_key_index_t *index, bmp_pos_t pos, bmp_channel_t channel, bool bit) {
+    size_t slot = key_slot(index, pos, channel);
+    index->saved[slot / SLOTS_PER_WORD] |= (uint64_t) bit << (slot % SLOTS_PER_WORD);
+}
+
+// Restores the original low bit of every slot written so far
+static void roll_back_slots(bmp_t *bmp, const stego_key_index_t *index) {
+    size_t words = ((size_t) index->size.width * index->size.height * CHANNELS_PER_PIXEL) /
+                   SLOTS_PER_WORD + 1;
+
+    for (size_t w = 0; w < words; ++w) {
+        if (index->slots[w] == 0)
+            continue;
+
+        for (int i = 0; i < SLOTS_PER_WORD; ++i) {
+            if (!((index->slots[w] >> i) & 1))
+                continue;
+
+            size_t slot = w * SLOTS_PER_WORD + i;
+            size_t pixel = slot / CHANNELS_PER_PIXEL;
+            bmp_pos_t pos = {(int32_t) (pixel % index->size.width), (int32_t) (pixel / index->size.width)};
+
+            put_bit_into_bmp(bmp, pos, (bmp_channel_t) (slot % CHANNELS_PER_PIXEL),
+                             (index->saved[w] >> i) & 1);
+        }
+    }
+}
+
+static stego_err_t put_letter_in_bmp(bmp_t *bmp, stego_reader_t *key_reader,
+                                     stego_key_index_t *index, int letter) {
     int encoded = encode_letter((char) letter);
 
     for (int i = 0; i < BITS_PER_LETTER; ++i) {
@@ -99,11 +280,21 @@ static stego_err_t put_letter_in_bmp(bmp_t *bmp, FILE *key_file, int letter) {
         bmp_pos_t pos;
         bmp_channel_t channel;
 
-        if (read_key_row(key_file, &pos, &channel) != 0)
+        if (read_key_row(key_reader, &pos, &channel) != 0)
             return STEGO_ERR_READ_KEY;
 
-        if (put_bit_into_bmp(bmp, pos, channel, bit) != STEGO_OK)
+        if (!key_row_in_bounds(index, pos))
+            return STEGO_ILLEGAL_ARGUMENTS;
+
+        // Reusing a slot would silently overwrite an earlier bit
+        if (test_and_set_slot(index, pos, channel))
+            return STEGO_ERR_KEY_COLLISION;
+
+        bool old_bit = 0;
+        if (get_bit_from_bmp(bmp, pos, channel, &old_bit) != STEGO_OK ||
+            put_bit_into_bmp(bmp, pos, channel, bit) != STEGO_OK)
             return STEGO_ILLEGAL_ARGUMENTS;
+        save_slot_bit(index, pos, channel, old_bit);
     }
 
     return STEGO_OK;
@@ -112,17 +303,40 @@ static stego_err_t put_letter_in_bmp(bmp_t *bmp, FILE *key_file, int letter) {
 stego_err_t write_msg_into_bmp(bmp_t *dst, FILE *key_file, FILE *msg_file) {
     stego_err_t stego_err;
 
-    int letter;
-    while ((letter = getc(msg_file)) != EOF)
-        if ((stego_err = put_letter_in_bmp(dst, key_file, letter)) != STEGO_OK)
-            return stego_err;
+    stego_key_index_t index = {{0, 0}, NULL, NULL};
+    stego_reader_t key_reader = {NULL, 0, 0, NULL};
+    stego_reader_t msg_reader = {NULL, 0, 0, NULL};
+
+    if ((stego_err = init_key_index(&index, dst)) != STEGO_OK ||
+        (stego_err = init_reader(&key_reader, key_file)) != STEGO_OK ||
+        (stego_err = init_reader(&msg_reader, msg_file)) != STEGO_OK)
+        goto clear;
+
+    // Message is consumed block by block straight from the reader buffer
+    while (fill_reader(&msg_reader)) {
+        for (size_t i = 0; i < msg_reader.len; ++i) {
+            stego_err = put_letter_in_bmp(dst, &key_reader, &index, msg_reader.buf[i]);
+            if (stego_err != STEGO_OK)
+                goto roll_back;
+        }
+    }
+
+    // Put zero byte additionally. The key may end before it is
+    // complete, but its rows must not collide or leave the image.
+    stego_err = put_letter_in_bmp(dst, &key_reader, &index, '\0');
+    if (stego_err == STEGO_ERR_READ_KEY)
+        stego_err = STEGO_OK;
 
-    // Put zero byte additionally.
-    // We don't check for errors to write
-    // if only we have more space in key.
-    put_letter_in_bmp(dst, key_file, '\0');
+    roll_back:
+        if (stego_err != STEGO_OK)
+            roll_back_slots(dst, &index);
 
-    return STEGO_OK;
+    clear:
+        free_key_index(&index);
+        free(key_reader.buf);
+        free(msg_reader.buf);
+
+    return stego_err;
 }
 
 stego_err_t read_msg_from_bmp(const bmp_t *src, FILE *key_file, FILE *msg_file) {
@@ -132,11 +346,20 @@ stego_err_t read_msg_from_bmp(const bmp_t *src, FILE *key_file, FILE *msg_file)
     int bit_cnt = 0;
     uint8_t cur_encoded = 0;
 
-    while (read_key_row(key_file, &pos, &channel) == 0) {
+    stego_err_t stego_err;
+    stego_reader_t key_reader = {NULL, 0, 0, NULL};
+    stego_writer_t msg_writer = {NULL, 0, NULL};
+
+    if ((stego_err = init_reader(&key_reader, key_file)) != STEGO_OK ||
+        (stego_err = init_writer(&msg_writer, msg_file)) != STEGO_OK)
+        goto clear;
+
+    while (read_key_row(&key_reader, &pos, &channel) == 0) {
         bool bit = 0;
 
-        stego_err_t stego_err = get_bit_from_bmp(src, pos, channel, &bit);
-        if (stego_err != STEGO_OK) return stego_err;
+        stego_err = get_bit_from_bmp(src, pos, channel, &bit);
+        if (stego_err != STEGO_OK)
+            break;
 
         cur_encoded |= (bit << bit_cnt);
         if (++bit_cnt % BITS_PER_LETTER == 0) {
@@ -145,13 +368,82 @@ stego_err_t read_msg_from_bmp(const bmp_t *src, FILE *key_file, FILE *msg_file)
             if (letter == '\0')
                 break;
 
-            if (putc(letter, msg_file) == EOF)
-                return STEGO_ERR_WRITE_MSG;
+            if (write_char(&msg_writer, letter) != 0) {
+                stego_err = STEGO_ERR_WRITE_MSG;
+                goto clear;
+            }
 
             cur_encoded = 0;
             bit_cnt = 0;
         }
     }
 
+    // Letters decoded before a bad key row are still written out
+    if (flush_writer(&msg_writer) != 0 || fflush(msg_file) != 0)
+        stego_err = STEGO_ERR_WRITE_MSG;
+
+    clear:
+        free(key_reader.buf);
+        free(msg_writer.buf);
+
+    return stego_err;
+}
+
+stego_err_t analyze_key(const bmp_t *bmp, FILE *key_file, stego_key_stats_t *stats) {
+    stego_key_index_t index;
+    stego_err_t stego_err = init_key_index(&index, bmp);
+    if (stego_err != STEGO_OK)
+        return stego_err;
+
+    stego_reader_t key_reader;
+    if ((stego_err = init_reader(&key_reader, key_file)) != STEGO_OK) {
+        free_key_index(&index);
+        return stego_err;
+    }
+
+    stats->entries = 0;
+    stats->out_of_bounds = 0;
+    stats->duplicates = 0;
+    stats->malformed = false;
+
+    // Rows before the first out-of-bounds or duplicate one are safe to use
+    size_t usable_rows = 0;
+    bool usable = true;
+
+    bmp_pos_t pos;
+    bmp_channel_t channel;
+
+    for (;;) {
+        skip_spaces(&key_reader);
+        if (peek_char(&key_reader) == EOF)
+            break;
+
+        if (read_key_row(&key_reader, &pos, &channel) != 0) {
+            stats->malformed = true;
+            break;
+        }
+
+        ++stats->entries;
+
+        if (!key_row_in_bounds(&index, pos)) {
+            ++stats->out_of_bounds;
+            usable = false;
+        } else if (test_and_set_slot(&index, pos, channel)) {
+            ++stats->duplicates;
+            usable = false;
+        } else if (usable) {
+            ++usable_rows;
+        }
+    }
+
+    // Insert tolerates a key ending within the terminating '\0', but not a
+    // bad row there, so the letter before such a row does not fit
+    size_t letters = usable_rows / BITS_PER_LETTER;
+    if (!usable)
+        letters = (letters > 0) ? letters - 1 : 0;
+    stats->capacity = letters;
+
+    free_key_index(&index);
+    free(key_reader.buf);
     return STEGO_OK;
 }
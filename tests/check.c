@@ -0,0 +1,856 @@
+// Differential checks of the optimized paths against straightforward
+// reference implementations, plus a throughput regression check.
+//
+// stego.c is included directly so that the buffered key parser can be
+// compared with fscanf row by row.
+
+#include "stego.c"
+
+#include <string.h>
+#include <time.h>
+
+#define ITERATIONS 200
+#define CROPS_PER_IMAGE 8
+#define KEY_ROWS 200000
+#define PERF_RUNS 5
+#define PERF_LETTERS 100000
+
+// Allowed time of each optimized path relative to its reference, see report_perf
+#define KEY_PARSER_MAX_RATIO 0.45   // fscanf("%d %d %c")
+#define RGB_REGION_MAX_RATIO 0.25   // load_bmp + crop_bmp of a 1024x1024 file
+#define RLE_REGION_MAX_RATIO 0.12   // the same for RLE24
+#define INSERT_MAX_RATIO 0.5        // fscanf key and getc message, bit by bit
+#define EXTRACT_MAX_RATIO 0.35      // fscanf key and putc message, bit by bit
+#define RLE_ENCODE_MAX_RATIO 2.1    // encoded runs only, pixel by pixel
+
+static int failures = 0;
+
+#define CHECK(cond) do {                                              \
+        if (!(cond)) {                                                \
+            fprintf(stderr, "%s:%d: check failed: %s\n",              \
+                    __FILE__, __LINE__, #cond);                       \
+            ++failures;                                               \
+        }                                                             \
+    } while (0)
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15u;
+
+static uint32_t next_rand(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t) (rng_state >> 32);
+}
+
+static uint32_t rand_range(uint32_t lo, uint32_t hi) {
+    return lo + next_rand() % (hi - lo + 1);
+}
+
+// Reference image: plain top-down array of pixels
+typedef struct {
+    uint32_t width, height;
+    rgb_triple_t *pixels;
+} ref_image_t;
+
+static rgb_triple_t ref_pixel(const ref_image_t *img, uint32_t x, uint32_t y) {
+    return img->pixels[(size_t) y * img->width + x];
+}
+
+static void ref_random_image(ref_image_t *img, uint32_t width, uint32_t height) {
+    img->width = width;
+    img->height = height;
+    img->pixels = malloc((size_t) width * height * sizeof(rgb_triple_t));
+
+    // Short runs of equal pixels so that RLE output has both kinds of runs
+    rgb_triple_t pxl = {0, 0, 0};
+    for (size_t i = 0; i < (size_t) width * height; ++i) {
+        if (next_rand() % 3 == 0) {
+            uint32_t r = next_rand();
+            pxl.b = (uint8_t) r;
+            pxl.g = (uint8_t) (r >> 8);
+            pxl.r = (uint8_t) (r >> 16);
+        }
+        img->pixels[i] = pxl;
+    }
+}
+
+static void ref_crop_rotate(ref_image_t *dst, const ref_image_t *src, bmp_rect_t r) {
+    dst->width = r.size.height;
+    dst->height = r.size.width;
+    dst->pixels = malloc((size_t) dst->width * dst->height * sizeof(rgb_triple_t));
+
+    for (uint32_t y = 0; y < dst->height; ++y)
+        for (uint32_t x = 0; x < dst->width; ++x)
+            dst->pixels[(size_t) y * dst->width + x] =
+                ref_pixel(src, r.pos.x + y, r.pos.y + r.size.height - 1 - x);
+}
+
+static void put_le(uint8_t *dst, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i)
+        dst[i] = (uint8_t) (value >> (8 * i));
+}
+
+// Uncompressed BMP file built field by field from the format description
+static uint8_t *ref_rgb_file(const ref_image_t *img, size_t *file_size) {
+    size_t stride = ((size_t) img->width * 3 + 3) / 4 * 4;
+    size_t image_size = stride * img->height;
+    *file_size = 54 + image_size;
+
+    uint8_t *file = calloc(1, *file_size);
+    put_le(file + 0, 0x4D42, 2);              // "BM"
+    put_le(file + 2, (uint32_t) *file_size, 4);
+    put_le(file + 10, 54, 4);                 // Pixel data offset
+    put_le(file + 14, 40, 4);                 // BITMAPINFOHEADER
+    put_le(file + 18, img->width, 4);
+    put_le(file + 22, img->height, 4);
+    put_le(file + 26, 1, 2);                  // Planes
+    put_le(file + 28, 24, 2);                 // Bits per pixel
+    put_le(file + 34, (uint32_t) image_size, 4);
+
+    for (uint32_t y = 0; y < img->height; ++y) {
+        uint8_t *row = file + 54 + (size_t) (img->height - 1 - y) * stride;
+        memcpy(row, &img->pixels[(size_t) y * img->width], (size_t) img->width * 3);
+    }
+    return file;
+}
+
+static bool same_pixels(const bmp_t *bmp, const ref_image_t *img) {
+    bmp_size_t size = get_bmp_size(bmp);
+    if (size.width != img->width || size.height != img->height)
+        return false;
+
+    for (uint32_t y = 0; y < img->height; ++y)
+        for (uint32_t x = 0; x < img->width; ++x) {
+            rgb_triple_t *pxl;
+            bmp_pos_t pos = {(int32_t) x, (int32_t) y};
+            rgb_triple_t ref = ref_pixel(img, x, y);
+            if (get_pixel_in_bmp(bmp, pos, &pxl) != BMP_OK || memcmp(pxl, &ref, sizeof(ref)) != 0)
+                return false;
+        }
+    return true;
+}
+
+static FILE *file_with(const void *data, size_t size) {
+    FILE *file = tmpfile();
+    if (file) {
+        fwrite(data, 1, size, file);
+        rewind(file);
+    }
+    return file;
+}
+
+static bool file_equals(FILE *file, const uint8_t *data, size_t size) {
+    if (fseek(file, 0, SEEK_END) != 0 || (size_t) ftell(file) != size)
+        return false;
+    rewind(file);
+
+    uint8_t *content = malloc(size);
+    bool same = fread(content, 1, size, file) == size && memcmp(content, data, size) == 0;
+    free(content);
+    return same;
+}
+
+static bmp_rect_t random_rect(uint32_t width, uint32_t height) {
+    bmp_rect_t r;
+    r.size.width = rand_range(1, width);
+    r.size.height = rand_range(1, height);
+    r.pos.x = (int32_t) rand_range(0, width - r.size.width);
+    r.pos.y = (int32_t) rand_range(0, height - r.size.height);
+    return r;
+}
+
+// Crop and rotate through every loading path and compare with the reference
+static void check_crops(const ref_image_t *img, const uint8_t *file, size_t file_size, FILE *in) {
+    bmp_t *full = NULL;
+    CHECK(load_bmp_mem(&full, file, file_size) == BMP_OK);
+    if (!full)
+        return;
+
+    for (int i = 0; i < CROPS_PER_IMAGE; ++i) {
+        bmp_rect_t r = random_rect(img->width, img->height);
+
+        ref_image_t expected;
+        ref_crop_rotate(&expected, img, r);
+
+        bmp_t *cropped = NULL, *region = NULL, *mem_region = NULL, *rotated = NULL;
+        CHECK(crop_bmp(&cropped, full, r) == BMP_OK);
+        CHECK(load_bmp_region(&region, in, r) == BMP_OK);
+        CHECK(load_bmp_mem_region(&mem_region, file, file_size, r) == BMP_OK);
+
+        bmp_t *sources[] = {cropped, region, mem_region};
+        for (size_t s = 0; s < sizeof(sources) / sizeof(sources[0]); ++s) {
+            if (!sources[s])
+                continue;
+            CHECK(rotate_bmp(&rotated, sources[s], BMP_ROT_CLOCKWISE_90) == BMP_OK);
+            CHECK(rotated && same_pixels(rotated, &expected));
+            if (rotated)
+                free_bmp(rotated);
+            rotated = NULL;
+        }
+
+        if (cropped) {
+            bmp_size_t rot_size = {r.size.height, r.size.width};
+            size_t buf_size = bmp_buffer_size(r.size), rot_buf_size = bmp_buffer_size(rot_size);
+            void *buf = malloc(buf_size), *rot_buf = malloc(rot_buf_size);
+            bmp_t *c = NULL, *rot = NULL;
+            CHECK(crop_bmp_into(&c, full, r, buf, buf_size) == BMP_OK);
+            CHECK(c && rotate_bmp_into(&rot, c, BMP_ROT_CLOCKWISE_90, rot_buf, rot_buf_size) == BMP_OK);
+            CHECK(rot && same_pixels(rot, &expected));
+            free(buf);
+            free(rot_buf);
+        }
+
+        if (cropped)
+            free_bmp(cropped);
+        if (region)
+            free_bmp(region);
+        if (mem_region)
+            free_bmp(mem_region);
+        free(expected.pixels);
+    }
+
+    bmp_rect_t outside = {{0, 0}, {img->width + 1, 1}};
+    bmp_t *bad = NULL;
+    CHECK(load_bmp_mem_region(&bad, file, file_size, outside) == BMP_ERR_ILLEGAL_ARGS);
+
+    if (full)
+        free_bmp(full);
+}
+
+static void check_image(uint32_t width, uint32_t height) {
+    ref_image_t img;
+    ref_random_image(&img, width, height);
+
+    size_t rgb_size;
+    uint8_t *rgb = ref_rgb_file(&img, &rgb_size);
+
+    // Loading from a file, from memory and into caller buffers
+    FILE *in = file_with(rgb, rgb_size);
+    bmp_t *bmp = NULL, *mem = NULL, *into = NULL, *truncated = NULL;
+    size_t buf_size = 0;
+    CHECK(load_bmp(&bmp, in) == BMP_OK && same_pixels(bmp, &img));
+    CHECK(load_bmp_mem(&mem, rgb, rgb_size) == BMP_OK && same_pixels(mem, &img));
+    CHECK(probe_bmp_mem(rgb, rgb_size, &buf_size) == BMP_OK);
+    void *buf = malloc(buf_size);
+    CHECK(load_bmp_mem_into(&into, rgb, rgb_size, buf, buf_size) == BMP_OK &&
+          same_pixels(into, &img));
+    CHECK(load_bmp_mem(&truncated, rgb, rgb_size - 1) != BMP_OK);
+    free(buf);
+
+    size_t file_buf_size = 0;
+    CHECK(probe_bmp(in, &file_buf_size) == BMP_OK && file_buf_size == buf_size);
+    buf = malloc(file_buf_size);
+    CHECK(load_bmp_into(&into, in, buf, file_buf_size) == BMP_OK && same_pixels(into, &img));
+    free(buf);
+    if (mem)
+        free_bmp(mem);
+
+    if (!bmp) {
+        fclose(in);
+        free(rgb);
+        free(img.pixels);
+        return;
+    }
+
+    // Saving must reproduce the reference file byte for byte
+    CHECK(bmp_file_size(bmp) == rgb_size);
+    uint8_t *saved = malloc(rgb_size);
+    CHECK(save_bmp_mem(bmp, saved, rgb_size) == BMP_OK && memcmp(saved, rgb, rgb_size) == 0);
+    free(saved);
+
+    FILE *out = tmpfile();
+    CHECK(save_bmp(bmp, out) == BMP_OK && file_equals(out, rgb, rgb_size));
+    fclose(out);
+
+    check_crops(&img, rgb, rgb_size, in);
+
+    // RLE24 output read back through the same paths
+    size_t rle_size = bmp_file_size_enc(bmp, BMP_ENC_RLE24), written = 0;
+    uint8_t *rle = malloc(rle_size);
+    CHECK(save_bmp_mem_enc(bmp, rle, rle_size - 1, BMP_ENC_RLE24, &written) == BMP_ERR_ILLEGAL_ARGS);
+    CHECK(save_bmp_mem_enc(bmp, rle, rle_size, BMP_ENC_RLE24, &written) == BMP_OK &&
+          written == rle_size);
+
+    out = tmpfile();
+    CHECK(save_bmp_enc(bmp, out, BMP_ENC_RLE24) == BMP_OK && file_equals(out, rle, rle_size));
+    check_crops(&img, rle, rle_size, out);
+    fclose(out);
+
+    free(rle);
+    if (bmp)
+        free_bmp(bmp);
+    fclose(in);
+    free(rgb);
+    free(img.pixels);
+}
+
+static void check_images(void) {
+    // Every width remainder modulo 4 appears many times
+    for (int i = 0; i < ITERATIONS; ++i)
+        check_image(rand_range(1, 67), rand_range(1, 40));
+}
+
+typedef struct {
+    int32_t x, y;
+    char channel;
+} ref_key_row_t;
+
+// Rows up to the first one the original fscanf-based parser rejected
+static size_t ref_read_key(FILE *file, ref_key_row_t *rows, size_t max_rows) {
+    size_t count = 0;
+    ref_key_row_t row;
+    while (count < max_rows && fscanf(file, "%d %d %c", &row.x, &row.y, &row.channel) == 3 &&
+           strchr("RGB", row.channel) && row.channel != '\0')
+        rows[count++] = row;
+    return count;
+}
+
+static const char *const key_separators[] = {" ", "  ", "\t", "\n", "\r\n", " \n\t"};
+
+static void put_key_int(FILE *file, int32_t v) {
+    // Explicit plus signs and leading zeros are valid for %d as well
+    if (v < 0)
+        fputc('-', file);
+    else if (next_rand() % 16 == 0)
+        fputc('+', file);
+    if (next_rand() % 16 == 0)
+        fputs("00", file);
+    fprintf(file, "%ld", labs((long) v));
+}
+
+static FILE *random_key(size_t rows, uint32_t max_coord, bool garbage) {
+    static const char *const tails[] = {"12 x", "5 6 Q", "-", "7", "3 4", "+ 1 2 R", "1 -2"};
+    const size_t separators = sizeof(key_separators) / sizeof(key_separators[0]);
+
+    FILE *file = tmpfile();
+    for (size_t i = 0; i < rows; ++i) {
+        put_key_int(file, (int32_t) rand_range(0, max_coord) - (next_rand() % 64 == 0 ? 5 : 0));
+        fputs(key_separators[next_rand() % separators], file);
+        put_key_int(file, (int32_t) rand_range(0, max_coord));
+        fputs(key_separators[next_rand() % separators], file);
+        fputc("RGB"[next_rand() % 3], file);
+        fputs(key_separators[next_rand() % separators], file);
+    }
+    if (garbage)
+        fputs(tails[next_rand() % (sizeof(tails) / sizeof(tails[0]))], file);
+    rewind(file);
+    return file;
+}
+
+static void check_key_parser(void) {
+    ref_key_row_t *rows = malloc(KEY_ROWS * sizeof(ref_key_row_t));
+
+    for (int i = 0; i < 40; ++i) {
+        // Large keys cross reader block boundaries inside tokens
+        size_t count = (i % 4 == 0) ? KEY_ROWS - 10 : rand_range(0, 300);
+        FILE *file = random_key(count, rand_range(1, 100000), i % 2 == 1);
+
+        size_t expected = ref_read_key(file, rows, KEY_ROWS);
+        rewind(file);
+
+        stego_reader_t reader;
+        CHECK(init_reader(&reader, file) == STEGO_OK);
+
+        size_t parsed = 0;
+        bmp_pos_t pos;
+        bmp_channel_t channel;
+        while (read_key_row(&reader, &pos, &channel) == 0) {
+            if (parsed < expected) {
+                static const bmp_channel_t channels[] = {['R'] = BMP_CHANNEL_R,
+                                                         ['G'] = BMP_CHANNEL_G,
+                                                         ['B'] = BMP_CHANNEL_B};
+                CHECK(pos.x == rows[parsed].x && pos.y == rows[parsed].y &&
+                      channel == channels[(int) rows[parsed].channel]);
+            }
+            ++parsed;
+        }
+        CHECK(parsed == expected);
+
+        free(reader.buf);
+        fclose(file);
+    }
+
+    free(rows);
+}
+
+static const char message_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ .,";
+
+static int ref_encode_letter(char c) {
+    return (c == '\0') ? 0 : (int) (strchr(message_alphabet, c) - message_alphabet) + 1;
+}
+
+// Bit-by-bit insertion and extraction as in the original implementation
+static bool ref_insert(bmp_t *bmp, const ref_key_row_t *rows, size_t count, const char *msg) {
+    bmp_size_t size = get_bmp_size(bmp);
+    uint8_t *used = calloc((size_t) size.width * size.height * 3, 1);
+    size_t next = 0;
+    bool ok = true;
+
+    // Only the terminating '\0' may be cut short by the end of the key
+    for (size_t i = 0; ok && i <= strlen(msg); ++i) {
+        int encoded = ref_encode_letter(msg[i]);
+        for (int b = 0; b < BITS_PER_LETTER; ++b) {
+            if (next == count) {
+                ok = (msg[i] == '\0');
+                break;
+            }
+            ref_key_row_t row = rows[next++];
+            int channel = (row.channel == 'R') ? 2 : (row.channel == 'G') ? 1 : 0;
+            if (row.x < 0 || row.y < 0 || (uint32_t) row.x >= size.width ||
+                (uint32_t) row.y >= size.height) {
+                ok = false;
+                break;
+            }
+            uint8_t *slot = &used[((size_t) row.y * size.width + row.x) * 3 + channel];
+            if (*slot) {
+                ok = false;
+                break;
+            }
+            *slot = 1;
+            bmp_pos_t pos = {row.x, row.y};
+            put_bit_into_bmp(bmp, pos, (bmp_channel_t) channel, (encoded >> b) & 1);
+        }
+    }
+
+    free(used);
+    return ok;
+}
+
+static bool same_images(const bmp_t *a, const bmp_t *b) {
+    size_t size = bmp_file_size(a);
+    if (size != bmp_file_size(b))
+        return false;
+
+    uint8_t *x = malloc(size), *y = malloc(size);
+    bool same = save_bmp_mem(a, x, size) == BMP_OK && save_bmp_mem(b, y, size) == BMP_OK &&
+                memcmp(x, y, size) == 0;
+    free(x);
+    free(y);
+    return same;
+}
+
+static FILE *random_msg(char *msg, size_t len) {
+    for (size_t i = 0; i < len; ++i)
+        msg[i] = message_alphabet[next_rand() % (sizeof(message_alphabet) - 1)];
+    msg[len] = '\0';
+    return file_with(msg, len);
+}
+
+// Key with distinct in-bounds slots, optionally with one bad row at defect_from or later
+static FILE *random_stego_key(ref_key_row_t *rows, size_t count, bmp_size_t size,
+                              int defect, size_t defect_from) {
+    size_t slots = (size_t) size.width * size.height * 3;
+    for (size_t i = 0; i < count; ++i) {
+        // Distinct while count <= slots as 7919 is a prime not dividing slots
+        size_t slot = (i * 7919 + 13) % slots;
+        rows[i].x = (int32_t) (slot / 3 % size.width);
+        rows[i].y = (int32_t) (slot / 3 / size.width);
+        rows[i].channel = "BGR"[slot % 3];
+    }
+    if (defect_from == 0)
+        defect_from = 1;
+    if (defect && count > defect_from) {
+        size_t at = rand_range((uint32_t) defect_from, (uint32_t) count - 1);
+        if (defect == 1)
+            rows[at] = rows[at - 1];
+        else
+            rows[at].x = (int32_t) size.width;
+    }
+
+    FILE *file = tmpfile();
+    for (size_t i = 0; i < count; ++i)
+        fprintf(file, "%d %d %c\n", (int) rows[i].x, (int) rows[i].y, rows[i].channel);
+    rewind(file);
+    return file;
+}
+
+static void check_stego(void) {
+    for (int i = 0; i < ITERATIONS; ++i) {
+        ref_image_t img;
+        ref_random_image(&img, rand_range(1, 40), rand_range(1, 40));
+        size_t file_size;
+        uint8_t *file = ref_rgb_file(&img, &file_size);
+
+        bmp_t *fast = NULL, *ref = NULL;
+        load_bmp_mem(&fast, file, file_size);
+        load_bmp_mem(&ref, file, file_size);
+
+        bmp_size_t size = {img.width, img.height};
+        size_t slots = (size_t) size.width * size.height * 3;
+        size_t len = rand_range(0, (uint32_t) (slots / BITS_PER_LETTER));
+        size_t rows_count = (i % 3 == 0) ? rand_range(0, (uint32_t) slots)
+                                         : (len + 1) * BITS_PER_LETTER + rand_range(0, 10);
+        if (rows_count > slots)
+            rows_count = slots;
+
+        char *msg = malloc(len + 1);
+        ref_key_row_t *rows = malloc((rows_count + 1) * sizeof(ref_key_row_t));
+        int defect = (i % 5 >= 3) ? 1 + (int) (next_rand() % 2) : 0;
+
+        // Every other bad row lands in the terminating '\0' or after it
+        size_t defect_from = (i % 2 == 0) ? len * BITS_PER_LETTER : 0;
+
+        FILE *msg_file = random_msg(msg, len);
+        FILE *key_file = random_stego_key(rows, rows_count, size, defect, defect_from);
+
+        stego_key_stats_t stats;
+        CHECK(analyze_key(fast, key_file, &stats) == STEGO_OK);
+        rewind(key_file);
+
+        bool ref_ok = ref_insert(ref, rows, rows_count, msg);
+        stego_err_t err = write_msg_into_bmp(fast, key_file, msg_file);
+        CHECK(ref_ok == (err == STEGO_OK));
+        // A bad row within the first '\0' fails even an empty message
+        CHECK(err == STEGO_OK ? len <= stats.capacity : len > stats.capacity || stats.capacity == 0);
+
+        if (err != STEGO_OK) {
+            // Failed inserts leave the image as it was
+            bmp_t *orig = NULL;
+            CHECK(load_bmp_mem(&orig, file, file_size) == BMP_OK && same_images(fast, orig));
+            if (orig)
+                free_bmp(orig);
+        } else if (ref_ok) {
+            CHECK(same_images(fast, ref));
+        }
+
+        if (err == STEGO_OK) {
+            // Extraction stops at '\0' or at the end of the key. Bad rows
+            // after the message are never reached.
+            FILE *out = tmpfile();
+            rewind(key_file);
+            CHECK(read_msg_from_bmp(fast, key_file, out) == STEGO_OK);
+            size_t expected = (rows_count / BITS_PER_LETTER > len) ? len : rows_count / BITS_PER_LETTER;
+            CHECK(file_equals(out, (const uint8_t *) msg, expected));
+            fclose(out);
+        }
+
+        fclose(msg_file);
+        fclose(key_file);
+        free(rows);
+        free(msg);
+        if (fast)
+            free_bmp(fast);
+        if (ref)
+            free_bmp(ref);
+        free(file);
+        free(img.pixels);
+    }
+}
+
+static double perf_slack(void) {
+    const char *env = getenv("BMP_PERF_SLACK");
+    double slack = env ? strtod(env, NULL) : 0;
+    return slack > 0 ? slack : 1.0;
+}
+
+// Time must stay within max_ratio of the reference. The limits sit 25-40%
+// above the ratios measured when they were set, so a fast path losing a
+// good part of its speedup fails even while still beating the reference.
+static void report_perf(const char *name, double time, double reference, double max_ratio) {
+    double ratio = time / reference;
+    printf("perf %s: %.2f ms, reference %.2f ms, ratio %.3f (limit %.3f)\n",
+           name, time * 1e3, reference * 1e3, ratio, max_ratio);
+    if (ratio > max_ratio * perf_slack()) {
+        fprintf(stderr, "perf %s regressed: %.3f of the reference, limit %.3f\n",
+                name, ratio, max_ratio * perf_slack());
+        ++failures;
+    }
+}
+
+static double seconds(clock_t start) {
+    return (double) (clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void perf_key_parser(void) {
+    FILE *file = random_key(KEY_ROWS, 4096, false);
+    ref_key_row_t *rows = malloc(KEY_ROWS * sizeof(ref_key_row_t));
+    double fast = 1e9, reference = 1e9;
+
+    for (int run = 0; run < PERF_RUNS; ++run) {
+        rewind(file);
+        clock_t start = clock();
+        CHECK(ref_read_key(file, rows, KEY_ROWS) == KEY_ROWS);
+        double t = seconds(start);
+        reference = t < reference ? t : reference;
+
+        rewind(file);
+        start = clock();
+        stego_reader_t reader;
+        init_reader(&reader, file);
+        size_t parsed = 0;
+        bmp_pos_t pos;
+        bmp_channel_t channel;
+        while (read_key_row(&reader, &pos, &channel) == 0)
+            ++parsed;
+        free(reader.buf);
+        t = seconds(start);
+        fast = t < fast ? t : fast;
+        CHECK(parsed == KEY_ROWS);
+    }
+
+    report_perf("key parser", fast, reference, KEY_PARSER_MAX_RATIO);
+    free(rows);
+    fclose(file);
+}
+
+static void perf_region(bmp_enc_t enc, const char *name, double max_ratio) {
+    ref_image_t img;
+    ref_random_image(&img, 1024, 1024);
+    size_t file_size;
+    uint8_t *file = ref_rgb_file(&img, &file_size);
+
+    bmp_t *bmp = NULL;
+    load_bmp_mem(&bmp, file, file_size);
+    FILE *in = tmpfile();
+    CHECK(save_bmp_enc(bmp, in, enc) == BMP_OK);
+    if (bmp)
+        free_bmp(bmp);
+
+    bmp_rect_t r = {{448, 448}, {128, 128}};
+    double fast = 1e9, reference = 1e9;
+
+    for (int run = 0; run < PERF_RUNS; ++run) {
+        bmp_t *full = NULL, *cropped = NULL, *region = NULL;
+
+        rewind(in);
+        clock_t start = clock();
+        CHECK(load_bmp(&full, in) == BMP_OK && crop_bmp(&cropped, full, r) == BMP_OK);
+        double t = seconds(start);
+        reference = t < reference ? t : reference;
+
+        start = clock();
+        CHECK(load_bmp_region(&region, in, r) == BMP_OK);
+        t = seconds(start);
+        fast = t < fast ? t : fast;
+
+        CHECK(region && cropped && same_images(region, cropped));
+        if (full)
+            free_bmp(full);
+        if (cropped)
+            free_bmp(cropped);
+        if (region)
+            free_bmp(region);
+    }
+
+    report_perf(name, fast, reference, max_ratio);
+    fclose(in);
+    free(file);
+    free(img.pixels);
+}
+
+// Insert as the original implementation did it, one fscanf per key row
+static void ref_insert_file(bmp_t *bmp, FILE *key_file, FILE *msg_file) {
+    for (int ch = 0; ch != EOF;) {
+        ch = getc(msg_file);
+        int encoded = (ch == EOF) ? 0 : ref_encode_letter((char) ch);
+        for (int b = 0; b < BITS_PER_LETTER; ++b) {
+            ref_key_row_t row;
+            if (fscanf(key_file, "%d %d %c", &row.x, &row.y, &row.channel) != 3)
+                return;
+            bmp_pos_t pos = {row.x, row.y};
+            bmp_channel_t channel = (row.channel == 'R') ? BMP_CHANNEL_R :
+                                    (row.channel == 'G') ? BMP_CHANNEL_G : BMP_CHANNEL_B;
+            put_bit_into_bmp(bmp, pos, channel, (encoded >> b) & 1);
+        }
+    }
+}
+
+static void ref_extract_file(const bmp_t *bmp, FILE *key_file, FILE *msg_file) {
+    for (;;) {
+        int encoded = 0;
+        for (int b = 0; b < BITS_PER_LETTER; ++b) {
+            ref_key_row_t row;
+            bool bit = 0;
+            if (fscanf(key_file, "%d %d %c", &row.x, &row.y, &row.channel) != 3)
+                return;
+            bmp_pos_t pos = {row.x, row.y};
+            bmp_channel_t channel = (row.channel == 'R') ? BMP_CHANNEL_R :
+                                    (row.channel == 'G') ? BMP_CHANNEL_G : BMP_CHANNEL_B;
+            get_bit_from_bmp(bmp, pos, channel, &bit);
+            encoded |= bit << b;
+        }
+        if (encoded == 0)
+            return;
+        putc(encoded < (int) sizeof(message_alphabet) ? message_alphabet[encoded - 1] : '?', msg_file);
+    }
+}
+
+static void perf_stego(void) {
+    ref_image_t img;
+    ref_random_image(&img, 1024, 1024);
+    size_t file_size;
+    uint8_t *file = ref_rgb_file(&img, &file_size);
+
+    bmp_t *fast = NULL, *ref = NULL;
+    CHECK(load_bmp_mem(&fast, file, file_size) == BMP_OK);
+    CHECK(load_bmp_mem(&ref, file, file_size) == BMP_OK);
+
+    bmp_size_t size = {img.width, img.height};
+    size_t rows_count = (PERF_LETTERS + 1) * BITS_PER_LETTER;
+    ref_key_row_t *rows = malloc(rows_count * sizeof(ref_key_row_t));
+    char *msg = malloc(PERF_LETTERS + 1);
+    FILE *key_file = random_stego_key(rows, rows_count, size, 0, 0);
+    FILE *msg_file = random_msg(msg, PERF_LETTERS);
+    FILE *out = tmpfile();
+
+    double insert = 1e9, ref_insert_time = 1e9, extract = 1e9, ref_extract_time = 1e9;
+    for (int run = 0; run < PERF_RUNS; ++run) {
+        rewind(key_file);
+        rewind(msg_file);
+        clock_t start = clock();
+        ref_insert_file(ref, key_file, msg_file);
+        double t = seconds(start);
+        ref_insert_time = t < ref_insert_time ? t : ref_insert_time;
+
+        rewind(key_file);
+        rewind(msg_file);
+        start = clock();
+        CHECK(write_msg_into_bmp(fast, key_file, msg_file) == STEGO_OK);
+        t = seconds(start);
+        insert = t < insert ? t : insert;
+
+        rewind(key_file);
+        rewind(out);
+        start = clock();
+        ref_extract_file(ref, key_file, out);
+        t = seconds(start);
+        ref_extract_time = t < ref_extract_time ? t : ref_extract_time;
+
+        rewind(key_file);
+        rewind(out);
+        start = clock();
+        CHECK(read_msg_from_bmp(fast, key_file, out) == STEGO_OK);
+        t = seconds(start);
+        extract = t < extract ? t : extract;
+    }
+    CHECK(file_equals(out, (const uint8_t *) msg, PERF_LETTERS));
+
+    report_perf("insert", insert, ref_insert_time, INSERT_MAX_RATIO);
+    report_perf("extract", extract, ref_extract_time, EXTRACT_MAX_RATIO);
+
+    fclose(out);
+    fclose(msg_file);
+    fclose(key_file);
+    free(msg);
+    free(rows);
+    if (fast)
+        free_bmp(fast);
+    if (ref)
+        free_bmp(ref);
+    free(file);
+    free(img.pixels);
+}
+
+// Plain RLE24 file without a strip index, encoded runs only
+static size_t ref_rle_file(const bmp_t *bmp, uint8_t *file) {
+    bmp_size_t size = get_bmp_size(bmp);
+    uint8_t *out = file + 78;
+
+    for (uint32_t stored = 0; stored < size.height; ++stored) {
+        bmp_pos_t pos = {0, (int32_t) (size.height - 1 - stored)};
+        while ((uint32_t) pos.x < size.width) {
+            rgb_triple_t *first, *next;
+            get_pixel_in_bmp(bmp, pos, &first);
+
+            int32_t run = 1;
+            bmp_pos_t at = {pos.x + 1, pos.y};
+            while (run < 255 && (uint32_t) at.x < size.width &&
+                   get_pixel_in_bmp(bmp, at, &next) == BMP_OK && memcmp(first, next, 3) == 0) {
+                ++run;
+                ++at.x;
+            }
+
+            *out++ = (uint8_t) run;
+            memcpy(out, first, 3);
+            out += 3;
+            pos.x += run;
+        }
+        *out++ = 0;
+        *out++ = (stored + 1 == size.height) ? 1 : 0;
+    }
+
+    size_t data_size = (size_t) (out - file) - 78;
+    memset(file, 0, 78);
+    put_le(file + 0, 0x4D42, 2);
+    put_le(file + 2, (uint32_t) (78 + data_size), 4);
+    put_le(file + 10, 78, 4);
+    put_le(file + 14, 64, 4);                 // OS/2 2.x header
+    put_le(file + 18, size.width, 4);
+    put_le(file + 22, size.height, 4);
+    put_le(file + 26, 1, 2);
+    put_le(file + 28, 24, 2);
+    put_le(file + 30, 4, 4);                  // BI_RLE24
+    put_le(file + 34, (uint32_t) data_size, 4);
+    return 78 + data_size;
+}
+
+static void perf_rle_encode(void) {
+    ref_image_t img;
+    ref_random_image(&img, 1024, 1024);
+    size_t file_size;
+    uint8_t *file = ref_rgb_file(&img, &file_size);
+
+    bmp_t *bmp = NULL;
+    CHECK(load_bmp_mem(&bmp, file, file_size) == BMP_OK);
+    if (!bmp) {
+        free(file);
+        free(img.pixels);
+        return;
+    }
+
+    // Room for the reference encoder's worst case of 4 bytes per pixel
+    size_t out_size = (size_t) img.width * img.height * 4 + 2 * img.height + 4096, written;
+    uint8_t *out = malloc(out_size);
+    double encode = 1e9, reference = 1e9;
+    size_t ref_size = 0;
+
+    for (int run = 0; run < PERF_RUNS; ++run) {
+        clock_t start = clock();
+        ref_size = ref_rle_file(bmp, out);
+        double t = seconds(start);
+        reference = t < reference ? t : reference;
+
+        start = clock();
+        CHECK(save_bmp_mem_enc(bmp, out, out_size, BMP_ENC_RLE24, &written) == BMP_OK);
+        t = seconds(start);
+        encode = t < encode ? t : encode;
+    }
+
+    // The reference output decodes through the path for files without an index
+    bmp_t *back = NULL;
+    ref_size = ref_rle_file(bmp, out);
+    CHECK(load_bmp_mem(&back, out, ref_size) == BMP_OK && same_pixels(back, &img));
+    if (back)
+        free_bmp(back);
+
+    report_perf("rle encode", encode, reference, RLE_ENCODE_MAX_RATIO);
+    free(out);
+    free_bmp(bmp);
+    free(file);
+    free(img.pixels);
+}
+
+int main(void) {
+    const char *seed = getenv("BMP_CHECK_SEED");
+    if (seed)
+        rng_state ^= strtoull(seed, NULL, 0) * 0x2545F4914F6CDD1Du;
+
+    init_stego();
+
+    check_images();
+    check_key_parser();
+    check_stego();
+
+    perf_key_parser();
+    perf_region(BMP_ENC_RGB, "rgb region load", RGB_REGION_MAX_RATIO);
+    perf_region(BMP_ENC_RLE24, "rle region load", RLE_REGION_MAX_RATIO);
+    perf_stego();
+    perf_rle_encode();
+
+    if (failures != 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,106 @@
+// Fuzz target for the stego key parser (libFuzzer entry point, see `make fuzz`).
+//
+// The input is used as a key for a small fixed image. The row-by-row parse
+// must agree with analyze_key, and insert/extract must not touch anything
+// outside the image whatever the key contains. stego.c is included directly
+// to reach the static parser.
+
+#define _POSIX_C_SOURCE 200809L // fmemopen
+
+#include "stego.c"
+
+#include <string.h>
+
+#define IMAGE_WIDTH 5
+#define IMAGE_HEIGHT 3
+#define IMAGE_STRIDE 16 // 5 pixels padded to 4 bytes
+#define IMAGE_FILE_SIZE (54 + IMAGE_STRIDE * IMAGE_HEIGHT)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static bmp_t *fixed_image(void) {
+    static uint8_t file[IMAGE_FILE_SIZE] = {
+        'B', 'M', IMAGE_FILE_SIZE, 0, 0, 0, 0, 0, 0, 0, 54, 0, 0, 0,
+        40, 0, 0, 0, IMAGE_WIDTH, 0, 0, 0, IMAGE_HEIGHT, 0, 0, 0, 1, 0, 24, 0
+    };
+    for (size_t i = 54; i < IMAGE_FILE_SIZE; ++i)
+        file[i] = (uint8_t) (i * 37);
+
+    bmp_t *bmp = NULL;
+    if (load_bmp_mem(&bmp, file, sizeof(file)) != BMP_OK)
+        abort();
+    return bmp;
+}
+
+static FILE *open_key(void *copy, const uint8_t *data, size_t size) {
+    FILE *file = fmemopen(memcpy(copy, data, size), size, "rb");
+    if (!file)
+        abort();
+    return file;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static bmp_t *image = NULL;
+    static FILE *sink = NULL;
+    if (!image) {
+        init_stego();
+        image = fixed_image();
+        sink = fopen("/dev/null", "wb");
+    }
+
+    // fmemopen rejects empty buffers
+    if (size == 0)
+        return 0;
+    void *copy = malloc(size);
+    if (!copy)
+        return 0;
+
+    FILE *key = open_key(copy, data, size);
+    stego_reader_t reader;
+    if (init_reader(&reader, key) != STEGO_OK)
+        abort();
+
+    // Parsing stops at the end of the input or at the first bad row
+    size_t rows = 0;
+    bool malformed = false;
+    bmp_pos_t pos;
+    bmp_channel_t channel;
+    for (;; ++rows) {
+        skip_spaces(&reader);
+        if (peek_char(&reader) == EOF)
+            break;
+        if (read_key_row(&reader, &pos, &channel) != 0) {
+            malformed = true;
+            break;
+        }
+        if (channel != BMP_CHANNEL_R && channel != BMP_CHANNEL_G && channel != BMP_CHANNEL_B)
+            abort();
+    }
+    free(reader.buf);
+    fclose(key);
+
+    stego_key_stats_t stats;
+    key = open_key(copy, data, size);
+    if (analyze_key(image, key, &stats) != STEGO_OK ||
+        stats.entries != rows || stats.malformed != malformed ||
+        stats.out_of_bounds + stats.duplicates > rows)
+        abort();
+    fclose(key);
+
+    key = open_key(copy, data, size);
+    read_msg_from_bmp(image, key, sink);
+    fclose(key);
+
+    bmp_t *dst = NULL;
+    if (clone_image(&dst, image) != BMP_OK)
+        abort();
+    FILE *msg = fmemopen("HELLO, WORLD.", 13, "rb");
+    key = open_key(copy, data, size);
+    write_msg_into_bmp(dst, key, msg);
+    fclose(key);
+    fclose(msg);
+    free_bmp(dst);
+
+    free(copy);
+    return 0;
+}
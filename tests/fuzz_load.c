@@ -0,0 +1,130 @@
+// Fuzz target for the bmp loaders (libFuzzer entry point, see `make fuzz`).
+//
+// Every input is loaded from memory. Inputs accepted there are loaded again
+// through a FILE and as regions, the results must agree with each other and
+// survive an RGB and an RLE24 round trip.
+
+#define _POSIX_C_SOURCE 200809L // fmemopen
+
+#include "bmp.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static bool same_size(const bmp_t *a, const bmp_t *b) {
+    bmp_size_t size = get_bmp_size(a);
+    return size.width == get_bmp_size(b).width && size.height == get_bmp_size(b).height;
+}
+
+// Pixels only: row padding of the input is kept as is by uncompressed loads
+static bool same_images(const bmp_t *a, const bmp_t *b) {
+    if (!same_size(a, b))
+        return false;
+
+    bmp_size_t size = get_bmp_size(a);
+    for (uint32_t y = 0; y < size.height; ++y)
+        for (uint32_t x = 0; x < size.width; ++x) {
+            bmp_pos_t pos = {(int32_t) x, (int32_t) y};
+            rgb_triple_t *pa, *pb;
+            if (get_pixel_in_bmp(a, pos, &pa) != BMP_OK || get_pixel_in_bmp(b, pos, &pb) != BMP_OK ||
+                memcmp(pa, pb, sizeof(rgb_triple_t)) != 0)
+                return false;
+        }
+    return true;
+}
+
+// Uncompressed input or RLE24 input exactly as the encoder writes it
+static bool trusted_index(const bmp_t *bmp, const uint8_t *data, size_t size) {
+    uint32_t compression;
+    memcpy(&compression, data + 30, sizeof(compression));
+    if (compression == 0)
+        return true;
+
+    size_t encoded_size = bmp_file_size_enc(bmp, BMP_ENC_RLE24), written;
+    uint8_t *encoded = encoded_size == size ? malloc(size) : NULL;
+    bool same = encoded && save_bmp_mem_enc(bmp, encoded, size, BMP_ENC_RLE24, &written) == BMP_OK &&
+                memcmp(encoded, data, size) == 0;
+    free(encoded);
+    return same;
+}
+
+static void check_round_trip(const bmp_t *bmp, bmp_enc_t enc) {
+    size_t size = bmp_file_size_enc(bmp, enc), written = 0;
+    uint8_t *encoded = malloc(size);
+    if (!encoded)
+        return;
+
+    bmp_t *back = NULL;
+    if (save_bmp_mem_enc(bmp, encoded, size, enc, &written) != BMP_OK || written != size ||
+        load_bmp_mem(&back, encoded, size) != BMP_OK || !same_images(bmp, back))
+        abort();
+
+    free_bmp(back);
+    free(encoded);
+}
+
+// Region derived from the input so that the fuzzer can steer it
+static bmp_rect_t pick_region(bmp_size_t size, const uint8_t *data, size_t data_size) {
+    uint32_t seed = 0;
+    for (size_t i = 0; i < data_size && i < 8; ++i)
+        seed = seed * 31 + data[data_size - 1 - i];
+
+    bmp_rect_t region;
+    region.size.width = 1 + seed % size.width;
+    region.size.height = 1 + (seed >> 8) % size.height;
+    region.pos.x = (int32_t) ((seed >> 16) % (size.width - region.size.width + 1));
+    region.pos.y = (int32_t) ((seed >> 24) % (size.height - region.size.height + 1));
+    return region;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    bmp_t *bmp = NULL;
+    if (load_bmp_mem(&bmp, data, size) != BMP_OK)
+        return 0;
+
+    // The FILE path cannot bound allocations by the input size, so it only
+    // sees inputs whose pixel data is known to be present
+    void *copy = malloc(size);
+    FILE *file = copy ? fmemopen(memcpy(copy, data, size), size, "rb") : NULL;
+    if (file) {
+        bmp_t *from_file = NULL;
+        if (load_bmp(&from_file, file) != BMP_OK || !same_images(bmp, from_file))
+            abort();
+        free_bmp(from_file);
+    }
+
+    bmp_rect_t region = pick_region(get_bmp_size(bmp), data, size);
+    bmp_t *cropped = NULL, *mem_region = NULL, *file_region = NULL;
+    if (crop_bmp(&cropped, bmp, region) != BMP_OK)
+        abort();
+
+    // Region loads trust the RLE24 strip index, so they only have to match
+    // the full load when the index is the one the encoder writes
+    bmp_err_t mem_err = load_bmp_mem_region(&mem_region, data, size, region);
+    if (trusted_index(bmp, data, size) ? mem_err != BMP_OK || !same_images(cropped, mem_region)
+                                       : mem_err == BMP_OK && !same_size(cropped, mem_region))
+        abort();
+
+    if (file) {
+        bmp_err_t file_err = load_bmp_region(&file_region, file, region);
+        if (file_err != mem_err || (file_err == BMP_OK && !same_images(mem_region, file_region)))
+            abort();
+    }
+
+    check_round_trip(bmp, BMP_ENC_RGB);
+    check_round_trip(bmp, BMP_ENC_RLE24);
+
+    if (cropped)
+        free_bmp(cropped);
+    if (mem_region)
+        free_bmp(mem_region);
+    if (file_region)
+        free_bmp(file_region);
+    if (file)
+        fclose(file);
+    free(copy);
+    free_bmp(bmp);
+    return 0;
+}
@@ -0,0 +1,47 @@
+// Standalone driver for the fuzz targets when libFuzzer is not available.
+// Runs the target on every file given on the command line, or on standard
+// input without arguments, which is what AFL expects.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static int run_file(FILE *file) {
+    size_t size = 0, capacity = 4096;
+    uint8_t *data = malloc(capacity);
+
+    for (size_t n; data && (n = fread(data + size, 1, capacity - size, file)) != 0;) {
+        size += n;
+        if (size == capacity) {
+            uint8_t *grown = realloc(data, capacity *= 2);
+            if (!grown)
+                free(data);
+            data = grown;
+        }
+    }
+    if (!data || ferror(file)) {
+        free(data);
+        return 1;
+    }
+
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2)
+        return run_file(stdin);
+
+    for (int i = 1; i < argc; ++i) {
+        FILE *file = fopen(argv[i], "rb");
+        if (!file || run_file(file) != 0) {
+            fprintf(stderr, "Cannot read %s\n", argv[i]);
+            return 1;
+        }
+        fclose(file);
+    }
+    return 0;
+}
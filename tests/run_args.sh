@@ -0,0 +1,55 @@
+#!/bin/sh
+# Runs every tests/*.args case against the given binary.
+#
+# TESTS_DIR and OUTPUT_FILE in the arguments are replaced with the tests
+# directory and a temporary output path. Cases named fail-* must exit with
+# a nonzero code, all others with zero. When <case>.expected.stdout exists
+# it is compared with the standard output, any other <case>.expected.*
+# file is compared with OUTPUT_FILE byte for byte.
+#
+# Usage: run_args.sh ./hw-01_bmp [tests-dir]
+
+bin=$1
+dir=${2:-$(dirname "$0")}
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+passed=0
+failed=0
+
+for args in "$dir"/*.args; do
+    name=$(basename "$args" .args)
+    out="$tmp/$name.out"
+    rm -f "$out"
+
+    cmd=$(sed -e "s|TESTS_DIR|$dir|g" -e "s|OUTPUT_FILE|$out|g" "$args")
+    # shellcheck disable=SC2086
+    $bin $cmd >"$tmp/stdout" 2>"$tmp/stderr"
+    code=$?
+
+    error=
+    case $name in
+        fail-*) [ $code -ne 0 ] || error="expected nonzero exit code" ;;
+        *)      [ $code -eq 0 ] || error="exit code $code: $(cat "$tmp/stderr")" ;;
+    esac
+
+    for expected in "$dir/$name".expected.*; do
+        [ -z "$error" ] && [ -e "$expected" ] || continue
+        case $expected in
+            *.expected.stdout) actual="$tmp/stdout" ;;
+            *)                 actual=$out ;;
+        esac
+        cmp -s "$expected" "$actual" || error="output differs from $(basename "$expected")"
+    done
+
+    if [ -z "$error" ]; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        echo "FAIL $name: $error"
+    fi
+done
+
+echo "args cases: $passed passed, $failed failed"
+[ $failed -eq 0 ]